@@ -0,0 +1,104 @@
+#!/bin/sh
+# Build patchelf and the benchmark tools.
+#
+#   bench/build.sh [--flavor plain|lto|pgo-generate|pgo-use] [patchelf] [microbench] [mkelf]
+#
+# With no targets, all three are built; the pgo flavours only build
+# patchelf.  The plain build goes to $BUILD_DIR (default: _build), the
+# others to $BUILD_DIR/FLAVOR.  Every flavour sets PATCHELF_BUILD_FLAVOR,
+# which --stats reports:
+#
+#   plain         -O2
+#   lto           -O2 -flto
+#   pgo-generate  lto, instrumented to write a profile to $BUILD_DIR/pgo/profile
+#   pgo-use       lto, optimised with that profile ("lto+pgo")
+#
+# bench/pgo-train.sh runs the whole pgo-generate, train, pgo-use cycle.
+# CXX and CXXFLAGS are honoured; CXXFLAGS replaces the -O2.
+set -e
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${BUILD_DIR:-$SRC/_build}
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--O2}
+COMMON="-std=c++17 -Wall -I$SRC"
+flavor=plain
+
+if [ "$1" = --flavor ]; then
+    flavor=$2
+    shift 2
+fi
+
+# Both pgo flavours compile the same object file, since the name of the
+# profile data is derived from its path.
+PGO_DIR=$BUILD_DIR/pgo
+case $flavor in
+plain)
+    OUT=$BUILD_DIR
+    FLAGS=
+    name=plain
+    ;;
+lto)
+    OUT=$BUILD_DIR/lto
+    FLAGS="-flto=auto"
+    name=lto
+    ;;
+pgo-generate)
+    OUT=$BUILD_DIR/pgo-generate
+    # Atomic counters, since --jobs runs files on several threads.
+    FLAGS="-flto=auto -fprofile-generate=$PGO_DIR/profile -fprofile-update=atomic"
+    name=lto+pgo-generate
+    ;;
+pgo-use)
+    OUT=$BUILD_DIR/pgo-use
+    [ -d "$PGO_DIR/profile" ] || { echo "build.sh: no profile in $PGO_DIR/profile, run bench/pgo-train.sh" >&2; exit 1; }
+    # Code the training didn't reach is optimised as usual rather than
+    # for size.
+    FLAGS="-flto=auto -fprofile-use=$PGO_DIR/profile -fprofile-partial-training -Wno-missing-profile"
+    name=lto+pgo
+    ;;
+*)
+    echo "build.sh: unknown flavor '$flavor'" >&2
+    exit 1
+    ;;
+esac
+FLAGS="$FLAGS -DPATCHELF_BUILD_FLAVOR=\"$name\""
+
+mkdir -p "$OUT"
+
+if [ $# -eq 0 ]; then
+    case $flavor in
+    pgo-*) set -- patchelf ;;
+    *) set -- patchelf microbench mkelf ;;
+    esac
+fi
+
+for target in "$@"; do
+    case $flavor/$target in
+    pgo-*/patchelf)
+        mkdir -p "$PGO_DIR"
+        $CXX $COMMON $CXXFLAGS $FLAGS -c "$SRC/patchelf.cc" -o "$PGO_DIR/patchelf.o"
+        $CXX $CXXFLAGS $FLAGS "$PGO_DIR/patchelf.o" -o "$OUT/patchelf" -lpthread
+        ;;
+    pgo-*/*)
+        echo "build.sh: the $flavor flavor only builds patchelf" >&2
+        exit 1
+        ;;
+    */patchelf)
+        $CXX $COMMON $CXXFLAGS $FLAGS "$SRC/patchelf.cc" -o "$OUT/patchelf" -lpthread
+        ;;
+    */microbench)
+        # microbench.cc includes patchelf.cc, whose command line code it
+        # doesn't use.
+        $CXX $COMMON -Wno-unused-function $CXXFLAGS $FLAGS "$SRC/bench/microbench.cc" -o "$OUT/microbench" -lpthread
+        ;;
+    */mkelf)
+        $CXX $COMMON $CXXFLAGS "$SRC/bench/mkelf.cc" -o "$OUT/mkelf"
+        ;;
+    *)
+        echo "build.sh: unknown target '$target'" >&2
+        exit 1
+        ;;
+    esac
+    echo "built $OUT/$target ($name)"
+done
@@ -0,0 +1,482 @@
+#pragma once
+
+/* Synthetic ELF images for the benchmarks and tests: 32/64-bit, little
+   or big endian, ET_DYN or ET_EXEC, with the number of sections,
+   dynamic symbols, DT_NEEDED entries and notes, the .dynstr size and
+   the file size all chosen by the caller.
+
+   The layout is that of a small linked object: a read-only PT_LOAD
+   holding the headers, .interp, the notes, .hash, .dynsym, .dynstr and
+   .text, a writable PT_LOAD holding .dynamic and .data, then the
+   non-allocated sections (padding, .bench.N fillers, .shstrtab) and the
+   section header table.  With SHN_LORESERVE or more sections the file
+   uses extended section numbering.  The images are meant for patchelf,
+   not for running: the code is not executable and the machine is only
+   picked to get the endianness and page size right. */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../elf.h"
+
+namespace elfgen {
+
+[[noreturn]] inline void error(const std::string & msg) {
+    throw std::runtime_error(msg);
+}
+
+struct Spec {
+    bool is64 = true;
+    bool bigEndian = false;
+    bool executable = false;     /* ET_EXEC with a PT_INTERP, otherwise ET_DYN */
+    size_t sections = 0;         /* extra non-allocated .bench.N sections */
+    size_t symbols = 16;         /* defined dynamic symbols */
+    size_t needed = 4;           /* DT_NEEDED entries, libneeded0.so ... */
+    size_t notes = 1;            /* SHT_NOTE sections */
+    size_t notesPerSegment = 1;  /* note sections per PT_NOTE, 0 for none */
+    size_t dynstrSize = 0;       /* minimum .dynstr size */
+    uint64_t fileSize = 0;       /* minimum file size, reached with a zero-filled section */
+    bool shuffleHeaders = false; /* write the section headers out of offset order */
+    bool sectionHeaders = true;  /* false: no section header table, as after sstrip */
+};
+
+/* The file as the non-zero byte ranges in it; everything else is zero,
+   so that multi-GB images can be written as sparse files. */
+struct Image {
+    struct Chunk {
+        uint64_t offset;
+        std::vector<unsigned char> bytes;
+    };
+    std::vector<Chunk> chunks;
+    uint64_t size = 0;
+
+    /* Add bytes past everything added so far. */
+    void put(uint64_t offset, const void * data, size_t length) {
+        if (offset < size)
+            throw std::logic_error("image contents must be added in offset order");
+        /* Small gaps are cheaper to store than a new chunk. */
+        if (chunks.empty() || offset > size + 4096)
+            chunks.push_back({ offset, {} });
+        auto & bytes = chunks.back().bytes;
+        size_t at = offset - chunks.back().offset;
+        if (bytes.size() < at + length) bytes.resize(at + length, 0);
+        memcpy(bytes.data() + at, data, length);
+        if (size < offset + length) size = offset + length;
+    }
+
+    std::vector<unsigned char> flatten() const {
+        std::vector<unsigned char> contents(size, 0);
+        for (auto & chunk : chunks)
+            memcpy(contents.data() + chunk.offset, chunk.bytes.data(), chunk.bytes.size());
+        return contents;
+    }
+
+    void write(const std::string & fileName) const {
+        int fd = open(fileName.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0777);
+        if (fd == -1)
+            error("opening '" + fileName + "': " + strerror(errno));
+        bool ok = ftruncate(fd, size) == 0;
+        for (auto & chunk : chunks) {
+            size_t done = 0;
+            while (ok && done < chunk.bytes.size()) {
+                ssize_t n = pwrite(fd, chunk.bytes.data() + done, chunk.bytes.size() - done, chunk.offset + done);
+                if (n <= 0) ok = false;
+                else done += n;
+            }
+        }
+        int savedErrno = errno;
+        if (close(fd) != 0 && ok) {
+            ok = false;
+            savedErrno = errno;
+        }
+        if (!ok)
+            error("writing '" + fileName + "': " + strerror(savedErrno));
+    }
+};
+
+struct Elf32Types {
+    using Ehdr = Elf32_Ehdr;
+    using Phdr = Elf32_Phdr;
+    using Shdr = Elf32_Shdr;
+    using Sym = Elf32_Sym;
+    using Dyn = Elf32_Dyn;
+    static constexpr unsigned char elfClass = ELFCLASS32;
+};
+
+struct Elf64Types {
+    using Ehdr = Elf64_Ehdr;
+    using Phdr = Elf64_Phdr;
+    using Shdr = Elf64_Shdr;
+    using Sym = Elf64_Sym;
+    using Dyn = Elf64_Dyn;
+    static constexpr unsigned char elfClass = ELFCLASS64;
+};
+
+/* SysV ELF hash, for .hash. */
+inline uint32_t sysvHash(const std::string & name) {
+    uint32_t h = 0;
+    for (unsigned char c : name) {
+        h = (h << 4) + c;
+        uint32_t g = h & 0xf0000000;
+        if (g) h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+template<class Types>
+class Generator {
+public:
+    explicit Generator(const Spec & spec) : spec(spec) { }
+
+    Image generate() {
+        using Ehdr = typename Types::Ehdr;
+        using Phdr = typename Types::Phdr;
+        using Shdr = typename Types::Shdr;
+        using Sym = typename Types::Sym;
+        using Dyn = typename Types::Dyn;
+
+        uint16_t machine = spec.bigEndian ? (spec.is64 ? EM_PPC64 : EM_PPC) : (spec.is64 ? EM_X86_64 : EM_386);
+        uint64_t pageSize = spec.bigEndian ? 0x10000 : 0x1000;
+        uint64_t base = spec.executable ? (spec.is64 ? 0x400000 : 0x10000000) : 0;
+        size_t wordSize = spec.is64 ? 8 : 4;
+
+        /* Program headers: PHDR, INTERP, two LOADs, DYNAMIC, the NOTEs
+           and GNU_STACK. */
+        size_t noteSegments = spec.notesPerSegment && spec.notes
+            ? (spec.notes + spec.notesPerSegment - 1) / spec.notesPerSegment : 0;
+        size_t phnum = 5 + (spec.executable ? 1 : 0) + noteSegments;
+        uint64_t offset = sizeof(Ehdr) + phnum * sizeof(Phdr);
+
+        auto add = [&](const std::string & name, uint32_t type, uint64_t flags, uint64_t align,
+                       std::vector<unsigned char> data, uint64_t size = 0) -> size_t {
+            Section s;
+            s.name = name;
+            s.type = type;
+            s.flags = flags;
+            s.align = align;
+            s.size = data.empty() ? size : data.size();
+            s.data = std::move(data);
+            offset = alignUp(offset, align);
+            s.offset = offset;
+            s.addr = flags & SHF_ALLOC ? base + offset : 0;
+            offset += s.size;
+            sections.push_back(std::move(s));
+            return sections.size() - 1;
+        };
+
+        sections.emplace_back(); /* the null section */
+
+        /* The read-only segment. */
+        size_t interp = 0;
+        if (spec.executable) {
+            std::string path = "/lib/ld-bench.so.1";
+            interp = add(".interp", SHT_PROGBITS, SHF_ALLOC, 1, bytes(path.c_str(), path.size() + 1));
+        }
+
+        std::vector<size_t> notes;
+        for (size_t i = 0; i < spec.notes; ++i) {
+            std::vector<unsigned char> note(12 + 8 + 16, 0);
+            wr32(note.data(), 6);                      /* n_namesz */
+            wr32(note.data() + 4, 16);                 /* n_descsz */
+            wr32(note.data() + 8, i == 0 ? NT_GNU_BUILD_ID : 0x100 + (uint32_t) i);
+            memcpy(note.data() + 12, "Bench", 6);
+            for (size_t b = 0; b < 16; ++b) note[20 + b] = (unsigned char) (i * 16 + b);
+            notes.push_back(add(".note.bench." + std::to_string(i), SHT_NOTE, SHF_ALLOC, 4, std::move(note)));
+        }
+
+        std::string dynStr(1, '\0');
+        auto addDynStr = [&](const std::string & s) {
+            size_t at = dynStr.size();
+            dynStr += s;
+            dynStr += '\0';
+            return at;
+        };
+        std::vector<size_t> neededNames;
+        for (size_t i = 0; i < spec.needed; ++i)
+            neededNames.push_back(addDynStr("libneeded" + std::to_string(i) + ".so"));
+        size_t soname = spec.executable ? 0 : addDynStr("libbench.so");
+        std::vector<std::string> symbolNames;
+        std::vector<size_t> symbolNameOffsets;
+        for (size_t i = 0; i < spec.symbols; ++i) {
+            symbolNames.push_back("bench_symbol_" + std::to_string(i));
+            symbolNameOffsets.push_back(addDynStr(symbolNames.back()));
+        }
+        if (dynStr.size() < spec.dynstrSize) dynStr.resize(spec.dynstrSize, '\0');
+
+        size_t nSyms = spec.symbols + 1;
+        size_t nBuckets = nSyms / 2 + 1;
+        std::vector<unsigned char> hashData((2 + nBuckets + nSyms) * 4, 0);
+        {
+            std::vector<uint32_t> bucket(nBuckets, 0), chain(nSyms, 0);
+            for (size_t i = 1; i < nSyms; ++i) {
+                uint32_t b = sysvHash(symbolNames[i - 1]) % nBuckets;
+                chain[i] = bucket[b];
+                bucket[b] = i;
+            }
+            wr32(hashData.data(), nBuckets);
+            wr32(hashData.data() + 4, nSyms);
+            for (size_t i = 0; i < nBuckets; ++i) wr32(hashData.data() + 8 + 4 * i, bucket[i]);
+            for (size_t i = 0; i < nSyms; ++i) wr32(hashData.data() + 8 + 4 * (nBuckets + i), chain[i]);
+        }
+        size_t hash = add(".hash", SHT_HASH, SHF_ALLOC, 4, std::move(hashData));
+        sections[hash].entsize = 4;
+
+        size_t dynsym = add(".dynsym", SHT_DYNSYM, SHF_ALLOC, wordSize, {}, nSyms * sizeof(Sym));
+        sections[dynsym].entsize = sizeof(Sym);
+        sections[dynsym].info = 1;
+        size_t dynstr = add(".dynstr", SHT_STRTAB, SHF_ALLOC, 1, bytes(dynStr.data(), dynStr.size()));
+        sections[dynsym].link = dynstr;
+        sections[hash].link = dynsym;
+
+        uint64_t textSize = std::max<uint64_t>(64, 16 * spec.symbols);
+        std::vector<unsigned char> code(textSize, 0);
+        for (size_t i = 0; i < textSize; ++i) code[i] = (unsigned char) (0x90 + i % 7);
+        size_t text = add(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, std::move(code));
+
+        /* The symbols need the final index of .text, so they are filled
+           in once the headers are ordered. */
+        uint64_t textEnd = offset;
+
+        /* The writable segment starts on a new page. */
+        offset = alignUp(offset, pageSize);
+        uint64_t rwStart = offset;
+        size_t nDyn = spec.needed + 7;
+        size_t dynamic = add(".dynamic", SHT_DYNAMIC, SHF_ALLOC | SHF_WRITE, wordSize, {}, nDyn * sizeof(Dyn));
+        sections[dynamic].entsize = sizeof(Dyn);
+        sections[dynamic].link = dynstr;
+        std::vector<unsigned char> dataBytes(64, 0);
+        for (size_t i = 0; i < dataBytes.size(); ++i) dataBytes[i] = (unsigned char) i;
+        add(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, wordSize, std::move(dataBytes));
+        uint64_t rwEnd = offset;
+
+        /* Non-allocated sections.  The padding comes first so that the
+           fillers, .shstrtab and the section headers end up past
+           fileSize. */
+        if (spec.fileSize > offset)
+            add(".bench.pad", SHT_PROGBITS, 0, 1, {}, spec.fileSize - offset);
+        for (size_t i = 0; i < spec.sections; ++i) {
+            auto n = std::to_string(i);
+            add(".bench." + n, SHT_PROGBITS, 0, 1, bytes(n.c_str(), n.size()));
+        }
+
+        std::string shStr(1, '\0');
+        for (auto & s : sections) {
+            if (s.name.empty()) continue;
+            s.nameOffset = shStr.size();
+            shStr += s.name;
+            shStr += '\0';
+        }
+        shStr += ".shstrtab";
+        shStr += '\0';
+        sections.emplace_back();
+        size_t shstrtab = sections.size() - 1;
+        sections[shstrtab].name = ".shstrtab";
+        sections[shstrtab].nameOffset = shStr.size() - 10;
+        sections[shstrtab].type = SHT_STRTAB;
+        sections[shstrtab].align = 1;
+        sections[shstrtab].offset = offset;
+        sections[shstrtab].size = shStr.size();
+        sections[shstrtab].data = bytes(shStr.data(), shStr.size());
+        offset += shStr.size();
+
+        uint64_t shoff = alignUp(offset, wordSize);
+        size_t shnum = sections.size();
+        bool extended = shnum >= SHN_LORESERVE;
+        if (Types::elfClass == ELFCLASS32 && shoff + shnum * sizeof(Shdr) > UINT32_MAX)
+            error("a 32-bit image can't extend past 4 GiB (" + std::to_string(shoff + shnum * sizeof(Shdr)) + " bytes)");
+
+        /* Header index of every section, the identity unless the headers
+           are shuffled (by a fixed LCG, so that runs are comparable).  The
+           shuffle stays below SHN_LORESERVE so that st_shndx can still
+           name .text. */
+        std::vector<size_t> headerIndex(shnum);
+        for (size_t i = 0; i < shnum; ++i) headerIndex[i] = i;
+        if (spec.shuffleHeaders) {
+            uint64_t state = 0x2545f4914f6cdd1dULL;
+            for (size_t i = std::min<size_t>(shnum, SHN_LORESERVE) - 1; i > 1; --i) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                std::swap(headerIndex[i], headerIndex[1 + (state >> 33) % i]);
+            }
+        }
+
+        std::vector<Sym> syms(nSyms);
+        memset(syms.data(), 0, syms.size() * sizeof(Sym));
+        for (size_t i = 1; i < nSyms; ++i) {
+            wr(syms[i].st_name, symbolNameOffsets[i - 1]);
+            wr(syms[i].st_info, (unsigned char) ((STB_GLOBAL << 4) | STT_FUNC));
+            wr(syms[i].st_shndx, headerIndex[text]);
+            wr(syms[i].st_value, sections[text].addr + 16 * ((i - 1) % (textSize / 16)));
+            wr(syms[i].st_size, 16);
+        }
+        sections[dynsym].data = bytes((const char *) syms.data(), syms.size() * sizeof(Sym));
+
+        std::vector<Dyn> dyns(nDyn);
+        memset(dyns.data(), 0, dyns.size() * sizeof(Dyn));
+        size_t d = 0;
+        auto dyn = [&](uint64_t tag, uint64_t value) {
+            wr(dyns[d].d_tag, tag);
+            wr(dyns[d].d_un.d_val, value);
+            d++;
+        };
+        for (auto name : neededNames) dyn(DT_NEEDED, name);
+        if (spec.executable) dyn(DT_DEBUG, 0);
+        else dyn(DT_SONAME, soname);
+        dyn(DT_HASH, sections[hash].addr);
+        dyn(DT_STRTAB, sections[dynstr].addr);
+        dyn(DT_SYMTAB, sections[dynsym].addr);
+        dyn(DT_STRSZ, sections[dynstr].size);
+        dyn(DT_SYMENT, sizeof(Sym));
+        dyn(DT_NULL, 0);
+        sections[dynamic].data = bytes((const char *) dyns.data(), dyns.size() * sizeof(Dyn));
+
+        /* The image is written front to back. */
+        Image image;
+
+        /* The ELF header. */
+        Ehdr ehdr;
+        memset(&ehdr, 0, sizeof(ehdr));
+        memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+        ehdr.e_ident[EI_CLASS] = Types::elfClass;
+        ehdr.e_ident[EI_DATA] = spec.bigEndian ? ELFDATA2MSB : ELFDATA2LSB;
+        ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+        ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        wr(ehdr.e_type, spec.executable ? ET_EXEC : ET_DYN);
+        wr(ehdr.e_machine, machine);
+        wr(ehdr.e_version, EV_CURRENT);
+        wr(ehdr.e_entry, sections[text].addr);
+        wr(ehdr.e_phoff, sizeof(Ehdr));
+        wr(ehdr.e_ehsize, sizeof(Ehdr));
+        wr(ehdr.e_phentsize, sizeof(Phdr));
+        wr(ehdr.e_phnum, phnum);
+        wr(ehdr.e_shentsize, sizeof(Shdr));
+        if (spec.sectionHeaders) {
+            wr(ehdr.e_shoff, shoff);
+            wr(ehdr.e_shnum, extended ? 0 : shnum);
+            wr(ehdr.e_shstrndx, headerIndex[shstrtab] >= SHN_LORESERVE ? SHN_XINDEX : headerIndex[shstrtab]);
+        }
+        image.put(0, &ehdr, sizeof(ehdr));
+
+        /* Program headers. */
+        std::vector<Phdr> phdrs(phnum);
+        memset(phdrs.data(), 0, phdrs.size() * sizeof(Phdr));
+        size_t p = 0;
+        auto segment = [&](uint32_t type, uint32_t flags, uint64_t start, uint64_t end, uint64_t align) {
+            wr(phdrs[p].p_type, type);
+            wr(phdrs[p].p_flags, flags);
+            wr(phdrs[p].p_offset, start);
+            wr(phdrs[p].p_vaddr, base + start);
+            wr(phdrs[p].p_paddr, base + start);
+            wr(phdrs[p].p_filesz, end - start);
+            wr(phdrs[p].p_memsz, end - start);
+            wr(phdrs[p].p_align, align);
+            p++;
+        };
+        segment(PT_PHDR, PF_R, sizeof(Ehdr), sizeof(Ehdr) + phnum * sizeof(Phdr), wordSize);
+        if (spec.executable)
+            segment(PT_INTERP, PF_R, sections[interp].offset, sections[interp].offset + sections[interp].size, 1);
+        segment(PT_LOAD, PF_R | PF_X, 0, textEnd, pageSize);
+        segment(PT_LOAD, PF_R | PF_W, rwStart, rwEnd, pageSize);
+        segment(PT_DYNAMIC, PF_R | PF_W, sections[dynamic].offset,
+            sections[dynamic].offset + sections[dynamic].size, wordSize);
+        for (size_t i = 0; i < noteSegments; ++i) {
+            size_t first = notes[i * spec.notesPerSegment];
+            size_t last = notes[std::min(notes.size(), (i + 1) * spec.notesPerSegment) - 1];
+            segment(PT_NOTE, PF_R, sections[first].offset, sections[last].offset + sections[last].size, 4);
+        }
+        segment(PT_GNU_STACK, PF_R | PF_W, 0, 0, 16);
+        wr(phdrs[p - 1].p_vaddr, 0);
+        wr(phdrs[p - 1].p_paddr, 0);
+        image.put(sizeof(Ehdr), phdrs.data(), phdrs.size() * sizeof(Phdr));
+
+        /* Section contents. */
+        for (auto & s : sections)
+            if (!s.data.empty()) image.put(s.offset, s.data.data(), s.data.size());
+
+        if (!spec.sectionHeaders)
+            return image;
+
+        /* Section headers. */
+        std::vector<Shdr> shdrs(shnum);
+        memset(shdrs.data(), 0, shdrs.size() * sizeof(Shdr));
+        for (size_t i = 1; i < shnum; ++i) {
+            auto & s = sections[i];
+            auto & shdr = shdrs[headerIndex[i]];
+            wr(shdr.sh_name, s.nameOffset);
+            wr(shdr.sh_type, s.type);
+            wr(shdr.sh_flags, s.flags);
+            wr(shdr.sh_addr, s.addr);
+            wr(shdr.sh_offset, s.offset);
+            wr(shdr.sh_size, s.size);
+            wr(shdr.sh_link, s.link ? headerIndex[s.link] : 0);
+            wr(shdr.sh_info, s.info);
+            wr(shdr.sh_addralign, s.align);
+            wr(shdr.sh_entsize, s.entsize);
+        }
+        if (extended) wr(shdrs[0].sh_size, shnum);
+        if (headerIndex[shstrtab] >= SHN_LORESERVE) wr(shdrs[0].sh_link, headerIndex[shstrtab]);
+        image.put(shoff, shdrs.data(), shdrs.size() * sizeof(Shdr));
+
+        return image;
+    }
+
+private:
+    struct Section {
+        std::string name;
+        size_t nameOffset = 0;
+        uint32_t type = SHT_NULL;
+        uint64_t flags = 0;
+        uint64_t addr = 0;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint64_t align = 0;
+        uint64_t entsize = 0;
+        size_t link = 0; /* by index in sections */
+        uint32_t info = 0;
+        std::vector<unsigned char> data; /* empty for zero-filled or synthesized contents */
+    };
+
+    const Spec & spec;
+    std::vector<Section> sections;
+
+    static uint64_t alignUp(uint64_t offset, uint64_t align) {
+        return align > 1 ? (offset + align - 1) / align * align : offset;
+    }
+
+    static std::vector<unsigned char> bytes(const char * data, size_t length) {
+        return std::vector<unsigned char>(data, data + length);
+    }
+
+    /* Store v in a field of the image in its byte order. */
+    template<class I>
+    void wr(I & field, uint64_t v) const {
+        if constexpr (sizeof(I) < sizeof(v))
+            if (v >> (8 * sizeof(I)) != 0)
+                error("value " + std::to_string(v) + " doesn't fit a " + std::to_string(8 * sizeof(I)) + "-bit field");
+        auto p = (unsigned char *) &field;
+        for (size_t n = 0; n < sizeof(I); ++n)
+            p[n] = (unsigned char) (v >> (8 * (spec.bigEndian ? sizeof(I) - 1 - n : n)));
+    }
+
+    void wr32(unsigned char * p, uint32_t v) const {
+        uint32_t word;
+        wr(word, v);
+        memcpy(p, &word, sizeof(word));
+    }
+};
+
+inline Image generate(const Spec & spec) {
+    if (!spec.is64 && spec.fileSize > UINT32_MAX)
+        error("file size " + std::to_string(spec.fileSize) + " is too large for a 32-bit image");
+    return spec.is64 ? Generator<Elf64Types>(spec).generate() : Generator<Elf32Types>(spec).generate();
+}
+
+}
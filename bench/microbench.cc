@@ -0,0 +1,308 @@
+/* Microbenchmarks of the ElfFile rewrite steps on synthetic images from
+   elfgen.h.  Each step is timed on its own, on a fresh copy of the image
+   with everything it depends on done outside the timed region:
+
+     constructor      parse the headers and section names
+     sortShdrs        sort the section headers (shuffled in the input)
+     getSectionIndex  look up every section once by name
+     replaceNeeded    stage a longer name for the first DT_NEEDED entry
+     commit           lay out the staged edit (rewriteSections)
+     shiftFile        insert a page in front of .text
+     rewriteHeaders   write back the program and section headers
+
+   The sweeps scale one property of the image at a time (sections,
+   symbols, DT_NEEDED entries, notes, .dynstr size, file size) and print
+   the median time of every step at every point, with the growth
+   exponent against the previous point: about 1 for linear behaviour, 2
+   for quadratic.  Steps whose exponent exceeds --limit are flagged and
+   listed at the end.
+
+   Build with bench/build.sh microbench. */
+
+#define PATCHELF_NO_MAIN
+#include "../patchelf.cc"
+
+#include <cmath>
+
+#include "elfgen.h"
+
+using ElfFile32 = ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>;
+using ElfFile64 = ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>;
+
+enum class Step { Constructor, SortShdrs, GetSectionIndex, ReplaceNeeded, Commit, ShiftFile, RewriteHeaders, Count };
+
+static const char * stepNames[] = {
+    "constructor", "sortShdrs", "getSectionIndex", "replaceNeeded", "commit", "shiftFile", "rewriteHeaders",
+};
+
+struct Sweep {
+    const char * name;
+    size_t elfgen::Spec::* field;
+    uint64_t elfgen::Spec::* field64;
+    std::vector<uint64_t> points;
+    std::vector<uint64_t> quickPoints;
+};
+
+static const std::vector<Sweep> sweeps = {
+    { "sections", &elfgen::Spec::sections, nullptr,
+      { 128, 256, 512, 1024, 2048, 4096, 8192, 16384 }, { 128, 512, 2048 } },
+    { "symbols", &elfgen::Spec::symbols, nullptr,
+      { 256, 1024, 4096, 16384, 65536 }, { 256, 4096 } },
+    { "needed", &elfgen::Spec::needed, nullptr,
+      { 4, 16, 64, 256, 1024 }, { 4, 64 } },
+    { "notes", &elfgen::Spec::notes, nullptr,
+      { 1, 4, 16, 64, 256 }, { 1, 16 } },
+    { "dynstr-size", &elfgen::Spec::dynstrSize, nullptr,
+      { 4 << 10, 64 << 10, 1 << 20, 16 << 20 }, { 4 << 10, 1 << 20 } },
+    { "file-size", nullptr, &elfgen::Spec::fileSize,
+      { 1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20 }, { 1 << 20, 16 << 20 } },
+};
+
+static double minSeconds = 0.05;
+static unsigned int minIterations = 5;
+static unsigned int maxIterations = 1000;
+
+/* A friend of ElfFile, so that the private rewrite steps can be timed
+   one by one. */
+struct ElfFileBench {
+    /* Median time of one step in nanoseconds. */
+    template<class Elf>
+    static double timeStep(const std::vector<unsigned char> & image, Step step) {
+        using Clock = std::chrono::steady_clock;
+
+        std::vector<double> samples;
+        auto deadline = Clock::now() + std::chrono::duration<double>(minSeconds);
+        size_t sink = 0;
+
+        while (samples.size() < maxIterations && (samples.size() < minIterations || Clock::now() < deadline)) {
+            auto contents = std::make_shared<std::vector<unsigned char>>(image);
+            std::optional<Elf> elf;
+            Clock::time_point start, stop;
+
+            if (step == Step::Constructor) {
+                start = Clock::now();
+                elf.emplace(contents);
+                stop = Clock::now();
+            } else {
+                elf.emplace(contents);
+            }
+
+            switch (step) {
+            case Step::Constructor:
+            case Step::Count:
+                break;
+
+            case Step::SortShdrs:
+                start = Clock::now();
+                elf->sortShdrs();
+                stop = Clock::now();
+                break;
+
+            case Step::GetSectionIndex: {
+                std::vector<std::string> names;
+                for (size_t i = 1; i < elf->shdrs.size(); ++i)
+                    names.push_back(elf->getSectionName(elf->shdrs[i]));
+                start = Clock::now();
+                for (auto & name : names)
+                    sink += elf->getSectionIndex(name);
+                stop = Clock::now();
+                break;
+            }
+
+            case Step::ReplaceNeeded:
+            case Step::Commit: {
+                std::map<std::string, std::string> libs = {
+                    { "libneeded0.so", "/opt/bench/lib/libneeded0-with-a-longer-name.so" },
+                };
+                if (step == Step::ReplaceNeeded) start = Clock::now();
+                elf->replaceNeeded(libs);
+                if (step == Step::Commit) start = Clock::now();
+                else stop = Clock::now();
+                elf->commit();
+                if (step == Step::Commit) stop = Clock::now();
+                break;
+            }
+
+            case Step::ShiftFile: {
+                auto startOffset = elf->rdi(elf->findSectionHeader(".text").sh_offset);
+                start = Clock::now();
+                elf->shiftFile(1, startOffset, 0);
+                stop = Clock::now();
+                break;
+            }
+
+            case Step::RewriteHeaders: {
+                uint64_t phdrAddress = 0;
+                for (auto & phdr : elf->phdrs)
+                    if (elf->rdi(phdr.p_type) == PT_PHDR)
+                        phdrAddress = elf->rdi(phdr.p_vaddr);
+                start = Clock::now();
+                elf->rewriteHeaders(phdrAddress);
+                stop = Clock::now();
+                break;
+            }
+            }
+
+            samples.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+        }
+
+        /* Keep the lookups from being optimized away. */
+        if (sink == (size_t) -1) fputc(0, stderr);
+
+        std::sort(samples.begin(), samples.end());
+        return samples[samples.size() / 2];
+    }
+};
+
+static double timeStep(const elfgen::Spec & spec, const std::vector<unsigned char> & image, Step step) {
+    return spec.is64 ? ElfFileBench::timeStep<ElfFile64>(image, step) : ElfFileBench::timeStep<ElfFile32>(image, step);
+}
+
+static std::string formatName(const elfgen::Spec & spec) {
+    return std::string(spec.is64 ? "64" : "32") + (spec.bigEndian ? "be" : "le") + (spec.executable ? "-exec" : "-dyn");
+}
+
+static std::string formatTime(double ns) {
+    char buf[32];
+    if (ns < 1e3) snprintf(buf, sizeof(buf), "%.0f ns", ns);
+    else if (ns < 1e6) snprintf(buf, sizeof(buf), "%.2f us", ns / 1e3);
+    else if (ns < 1e9) snprintf(buf, sizeof(buf), "%.2f ms", ns / 1e6);
+    else snprintf(buf, sizeof(buf), "%.2f s", ns / 1e9);
+    return buf;
+}
+
+static void showBenchHelp(const char * progName) {
+    fprintf(stderr, "syntax: %s\n\
+  [--quick]\n\
+  [--all-formats]\n\
+  [--format 32le|32be|64le|64be[-dyn|-exec]]\n\
+  [--sweep sections|symbols|needed|notes|dynstr-size|file-size]\n\
+  [--step NAME]\n\
+  [--min-time SECONDS]\n\
+  [--limit EXPONENT]\n", progName);
+}
+
+static int benchMain(int argc, char * * argv) {
+    bool quick = false;
+    double limit = 1.5;
+    std::vector<elfgen::Spec> formats;
+    std::set<std::string> selectedSweeps, selectedSteps;
+
+    auto addFormats = [&](const std::string & name) {
+        if (name.size() < 4 || (name.compare(0, 2, "32") != 0 && name.compare(0, 2, "64") != 0)
+            || (name.compare(2, 2, "le") != 0 && name.compare(2, 2, "be") != 0))
+            error("unknown format '" + name + "'");
+        std::string type = name.substr(4);
+        if (type != "" && type != "-dyn" && type != "-exec")
+            error("unknown format '" + name + "'");
+        for (bool executable : { false, true }) {
+            if ((type == "-dyn" && executable) || (type == "-exec" && !executable)) continue;
+            elfgen::Spec spec;
+            spec.is64 = name.compare(0, 2, "64") == 0;
+            spec.bigEndian = name.compare(2, 2, "be") == 0;
+            spec.executable = executable;
+            formats.push_back(spec);
+        }
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--quick") quick = true;
+        else if (arg == "--all-formats") {
+            for (auto name : { "32le", "32be", "64le", "64be" })
+                addFormats(name);
+        }
+        else if (arg == "--format" && i + 1 < argc) addFormats(argv[++i]);
+        else if (arg == "--sweep" && i + 1 < argc) selectedSweeps.insert(argv[++i]);
+        else if (arg == "--step" && i + 1 < argc) selectedSteps.insert(argv[++i]);
+        else if (arg == "--min-time" && i + 1 < argc) minSeconds = atof(argv[++i]);
+        else if (arg == "--limit" && i + 1 < argc) limit = atof(argv[++i]);
+        else if (arg == "--help" || arg == "-h") {
+            showBenchHelp(argv[0]);
+            return 0;
+        } else {
+            showBenchHelp(argv[0]);
+            return 1;
+        }
+    }
+
+    if (formats.empty()) addFormats("64le");
+    if (quick) minIterations = 3;
+
+    for (auto & name : selectedSteps)
+        if (std::find_if(std::begin(stepNames), std::end(stepNames),
+                [&](const char * s) { return name == s; }) == std::end(stepNames))
+            error("unknown step '" + name + "'");
+    for (auto & name : selectedSweeps)
+        if (std::find_if(sweeps.begin(), sweeps.end(),
+                [&](const Sweep & s) { return name == s.name; }) == sweeps.end())
+            error("unknown sweep '" + name + "'");
+
+    std::vector<std::string> flagged;
+
+    printf("%-10s %-12s %10s  %-16s %12s %8s\n", "format", "sweep", "value", "step", "median", "growth");
+    for (auto & format : formats) {
+        for (auto & sweep : sweeps) {
+            if (!selectedSweeps.empty() && !selectedSweeps.count(sweep.name)) continue;
+
+            double previous[(size_t) Step::Count] = {};
+            uint64_t previousValue = 0;
+            for (auto value : quick ? sweep.quickPoints : sweep.points) {
+                elfgen::Spec spec = format;
+                spec.shuffleHeaders = true;
+                if (sweep.field) spec.*sweep.field = value;
+                else spec.*sweep.field64 = value;
+                auto image = elfgen::generate(spec).flatten();
+
+                for (size_t s = 0; s < (size_t) Step::Count; ++s) {
+                    if (!selectedSteps.empty() && !selectedSteps.count(stepNames[s])) continue;
+
+                    double ns;
+                    try {
+                        ns = timeStep(spec, image, (Step) s);
+                    } catch (std::exception & e) {
+                        printf("%-10s %-12s %10llu  %-16s error: %s\n", formatName(format).c_str(), sweep.name,
+                            (unsigned long long) value, stepNames[s], e.what());
+                        previous[s] = 0;
+                        continue;
+                    }
+
+                    /* Ignore growth below the timer's resolution. */
+                    std::string growth;
+                    if (previous[s] > 0 && ns > 1e4) {
+                        double exponent = std::log(ns / previous[s]) / std::log((double) value / previousValue);
+                        char buf[32];
+                        snprintf(buf, sizeof(buf), "%.2f%s", exponent, exponent > limit ? " !" : "");
+                        growth = buf;
+                        if (exponent > limit)
+                            flagged.push_back(formatName(format) + " " + sweep.name + " " + stepNames[s]
+                                + " (" + buf + " at " + std::to_string(value) + ")");
+                    }
+                    printf("%-10s %-12s %10llu  %-16s %12s %8s\n", formatName(format).c_str(), sweep.name,
+                        (unsigned long long) value, stepNames[s], formatTime(ns).c_str(), growth.c_str());
+                    fflush(stdout);
+                    previous[s] = ns;
+                }
+                previousValue = value;
+            }
+        }
+    }
+
+    if (!flagged.empty()) {
+        printf("\nsuper-linear growth (exponent > %.2f):\n", limit);
+        for (auto & f : flagged)
+            printf("  %s\n", f.c_str());
+    }
+
+    return 0;
+}
+
+int main(int argc, char * * argv) {
+    try {
+        return benchMain(argc, argv);
+    } catch (std::exception & e) {
+        flushLog();
+        fprintf(stderr, "microbench: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,93 @@
+/* Write a synthetic ELF image (see elfgen.h) to a file, e.g.
+
+     mkelf --class 32 --endian big --type exec --sections 70000 out
+
+   Large --file-size values produce sparse files. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "elfgen.h"
+
+static void showHelp(const char * progName) {
+    fprintf(stderr, "syntax: %s\n\
+  [--class 32|64]\n\
+  [--endian little|big]\n\
+  [--type dyn|exec]\n\
+  [--sections N]\n\
+  [--symbols N]\n\
+  [--needed N]\n\
+  [--notes N]\n\
+  [--notes-per-segment N]\n\
+  [--dynstr-size BYTES]\n\
+  [--file-size BYTES]\n\
+  [--shuffle-headers]\n\
+  [--no-section-headers]\n\
+  OUTPUT\n", progName);
+}
+
+static int mainWrapped(int argc, char * * argv) {
+    elfgen::Spec spec;
+    std::string outputFileName;
+
+    auto number = [&](int & i) {
+        if (++i == argc) throw std::runtime_error(std::string("missing argument to ") + argv[i - 1]);
+        char * end;
+        auto n = strtoull(argv[i], &end, 0);
+        if (*end) throw std::runtime_error(std::string("invalid number '") + argv[i] + "'");
+        return n;
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--class") {
+            auto n = number(i);
+            if (n != 32 && n != 64) throw std::runtime_error("--class must be 32 or 64");
+            spec.is64 = n == 64;
+        } else if (arg == "--endian" && i + 1 < argc) {
+            std::string e(argv[++i]);
+            if (e != "little" && e != "big") throw std::runtime_error("--endian must be little or big");
+            spec.bigEndian = e == "big";
+        } else if (arg == "--type" && i + 1 < argc) {
+            std::string t(argv[++i]);
+            if (t != "dyn" && t != "exec") throw std::runtime_error("--type must be dyn or exec");
+            spec.executable = t == "exec";
+        }
+        else if (arg == "--sections") spec.sections = number(i);
+        else if (arg == "--symbols") spec.symbols = number(i);
+        else if (arg == "--needed") spec.needed = number(i);
+        else if (arg == "--notes") spec.notes = number(i);
+        else if (arg == "--notes-per-segment") spec.notesPerSegment = number(i);
+        else if (arg == "--dynstr-size") spec.dynstrSize = number(i);
+        else if (arg == "--file-size") spec.fileSize = number(i);
+        else if (arg == "--shuffle-headers") spec.shuffleHeaders = true;
+        else if (arg == "--no-section-headers") spec.sectionHeaders = false;
+        else if (arg == "--help" || arg == "-h") {
+            showHelp(argv[0]);
+            return 0;
+        } else if (arg[0] != '-' && outputFileName.empty()) {
+            outputFileName = arg;
+        } else {
+            showHelp(argv[0]);
+            return 1;
+        }
+    }
+
+    if (outputFileName.empty()) {
+        showHelp(argv[0]);
+        return 1;
+    }
+
+    elfgen::generate(spec).write(outputFileName);
+    return 0;
+}
+
+int main(int argc, char * * argv) {
+    try {
+        return mainWrapped(argc, argv);
+    } catch (std::exception & e) {
+        fprintf(stderr, "mkelf: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,27 @@
+#! /bin/sh -e
+# Build the profile-guided patchelf: an instrumented build runs the
+# training workload, then the optimised build uses its profile.
+#
+#   bench/pgo-train.sh [--corpus DIR]
+#
+# The training workload is the bench/scenarios.sh run, once per
+# scenario: no edits, a --replace-needed that matches nothing, longer
+# DT_NEEDED names that relocate .dynstr in libraries, and the same edit
+# on executables, which shifts the file.  By default it runs on the
+# generated corpus; --corpus trains on a real tree instead.  The result
+# is $BUILD_DIR/pgo-use/patchelf; bench/RESULTS.md has the measurements.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${BUILD_DIR:-$SRC/_build}
+export BUILD_DIR
+
+rm -rf "$BUILD_DIR/pgo"
+"$SRC/bench/build.sh" --flavor pgo-generate
+"$SRC/bench/build.sh" mkelf >/dev/null
+
+# No baseline: the instrumented build is slow and only has to run.
+PATCHELF=$BUILD_DIR/pgo-generate/patchelf MKELF=$BUILD_DIR/mkelf WORK=$BUILD_DIR/pgo/work \
+    "$SRC/bench/scenarios.sh" --runs 1 --baseline /dev/null "$@"
+rm -rf "$BUILD_DIR/pgo/work"
+
+"$SRC/bench/build.sh" --flavor pgo-use
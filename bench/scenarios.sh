@@ -0,0 +1,178 @@
+#! /bin/sh -e
+# End-to-end throughput of the patchelf CLI, per scenario:
+#
+#   noop        no edits
+#   nomatch     --replace-needed with a name that matches nothing
+#   dynstr      --replace-needed with longer names, relocating .dynstr
+#   exec-shift  the same edit on the ET_EXEC files only, shifting the file
+#
+#   bench/scenarios.sh [--corpus DIR] [--baseline FILE] [--runs N]
+#                      [--threshold PERCENT] [--update]
+#
+# Without --corpus the files are generated with mkelf, so that every
+# machine runs the same corpus; with it, the ELF files under DIR (e.g. a
+# copy of /usr/lib) are used.  Each scenario runs on a fresh copy of the
+# corpus, up to N times (default 5); it passes as soon as one run is
+# within --stats-baseline of the baseline file (default
+# bench/baseline.txt, which is for the generated corpus), otherwise the
+# runner fails.  --update records the best files per second of every
+# scenario as the new baseline instead.  PATCHELF and MKELF may name prebuilt
+# binaries; otherwise bench/build.sh builds them.
+#
+# The default threshold of 50% is above the noise of the machine that
+# recorded bench/baseline.txt: over 20 sessions there, the best of 5 runs
+# fell up to 43% below the baseline (noop), so the gate only catches gross
+# regressions such as a step turning quadratic.  Pass a lower --threshold
+# on a quieter machine.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BASELINE=$SRC/bench/baseline.txt
+WORK=${WORK:-$SRC/_build/scenarios}
+corpus=
+runs=5
+threshold=50
+update=
+
+while [ $# -gt 0 ]; do
+    case $1 in
+    --corpus) corpus=$2; shift ;;
+    --baseline) BASELINE=$2; shift ;;
+    --runs) runs=$2; shift ;;
+    --threshold) threshold=$2; shift ;;
+    --update) update=1 ;;
+    *) echo "syntax: $0 [--corpus DIR] [--baseline FILE] [--runs N] [--threshold PERCENT] [--update]" >&2; exit 1 ;;
+    esac
+    shift
+done
+
+if [ -z "$PATCHELF" ] || { [ -z "$corpus" ] && [ -z "$MKELF" ]; }; then
+    "$SRC/bench/build.sh" patchelf mkelf >/dev/null
+    PATCHELF=${PATCHELF:-$SRC/_build/patchelf}
+    MKELF=${MKELF:-$SRC/_build/mkelf}
+fi
+
+rm -rf "$WORK"
+mkdir -p "$WORK/corpus"
+
+# The generated corpus: mostly small libraries, some large ones and
+# executables, in every class and byte order, about 150 MB in all
+# (sparse on disk).
+generate() {
+    n=$1; prefix=$2; shift 2
+    i=0
+    while [ $i -lt $n ]; do
+        "$MKELF" "$@" --needed $((2 + i % 6)) "$WORK/corpus/$prefix-$i"
+        i=$((i + 1))
+    done
+}
+
+if [ -z "$corpus" ]; then
+    generate 40 small --symbols 200
+    generate 8 small32 --class 32 --symbols 200
+    generate 8 smallbe --endian big --symbols 200
+    generate 20 medium --symbols 2000 --file-size 524288
+    generate 6 large --symbols 20000 --sections 200 --file-size 8388608
+    generate 2 huge --symbols 50000 --sections 1000 --file-size 33554432
+    generate 48 exec --type exec --symbols 100
+    generate 8 exec32 --type exec --class 32 --symbols 100
+    generate 8 execlarge --type exec --symbols 5000 --file-size 4194304
+else
+    # Dynamically linked executables and libraries only, since one file
+    # patchelf can't handle ends the batch; no symlinks, which would be
+    # patched twice.
+    find "$corpus" -type f | while read -r f; do
+        readelf -h "$f" 2>/dev/null | grep -Eq "Type: *(EXEC|DYN)" || continue
+        readelf -d "$f" 2>/dev/null | grep -q "(STRTAB)" || continue
+        cp "$f" "$WORK/corpus/$(echo "${f#$corpus/}" | tr / _)"
+    done
+fi
+
+baseline() {
+    if [ -f "$BASELINE" ]; then
+        awk -v s="$1" '$1 == s { print $2 }' "$BASELINE"
+    fi
+}
+
+replacements="--replace-needed libc.so.6 libc-with-a-much-longer-name.so.6
+    --replace-needed libm.so.6 libm-with-a-longer-name.so.6
+    --replace-needed libneeded0.so libneeded0-with-a-much-longer-name.so
+    --replace-needed libneeded1.so libneeded1-with-a-longer-name.so"
+
+failed=
+results=
+
+for scenario in noop nomatch dynstr exec-shift; do
+    case $scenario in
+    noop) args= ;;
+    nomatch) args="--replace-needed libnothing.so libstill-nothing.so" ;;
+    dynstr|exec-shift) args=$replacements ;;
+    esac
+
+    rate=$(baseline $scenario)
+    gate=
+    if [ -z "$update" ] && [ -n "$rate" ]; then
+        gate="--stats-baseline $rate:$threshold"
+    fi
+
+    best=0
+    bestLine=
+    passed=
+    broken=
+    run=0
+    while [ $run -lt "$runs" ] && [ -z "$passed" ]; do
+        rm -rf "$WORK/files"
+        cp -r "$WORK/corpus" "$WORK/files"
+        if [ $scenario = exec-shift ]; then
+            for f in "$WORK/files"/*; do
+                readelf -h "$f" 2>/dev/null | grep -q "Type: *EXEC" || rm "$f"
+            done
+        fi
+
+        # A run below the baseline fails with "throughput regressed";
+        # any other failure, or a run without a throughput line, means
+        # patchelf itself is broken.
+        status=0
+        "$PATCHELF" --stats $gate $args "$WORK/files"/* 2> "$WORK/stats" || status=$?
+        line=$(grep "^stats: throughput" "$WORK/stats" || true)
+        fps=$(echo "$line" | sed -n 's/.*, \([0-9.]*\) files\/s.*/\1/p')
+        if [ -z "$fps" ] || { [ $status -ne 0 ] && ! grep -q "throughput regressed" "$WORK/stats"; }; then
+            echo "$scenario: patchelf failed (exit status $status)"
+            grep -v "^stats:" "$WORK/stats" | head -5
+            broken=1
+            break
+        fi
+        [ -n "$gate" ] && [ $status -eq 0 ] && passed=1
+        if awk -v a="$fps" -v b="$best" 'BEGIN { exit !(a > b) }'; then
+            best=$fps
+            bestLine=$line
+        fi
+        run=$((run + 1))
+    done
+
+    if [ -n "$broken" ]; then
+        failed=1
+        continue
+    fi
+
+    echo "$scenario: ${bestLine#stats: }"
+    results="$results$scenario $best
+"
+    if [ -n "$gate" ] && [ -z "$passed" ]; then
+        echo "$scenario: REGRESSION, best $best files/s is more than $threshold% below the baseline of $rate"
+        failed=1
+    fi
+done
+
+if [ -n "$update" ] && [ -n "$failed" ]; then
+    echo "not updating $BASELINE"
+elif [ -n "$update" ]; then
+    {
+        echo "# Files per second of bench/scenarios.sh on ${corpus:-the generated corpus},"
+        echo "# best of $runs runs; regenerate with bench/scenarios.sh --update."
+        echo "# $(uname -m), $(nproc 2>/dev/null || echo ?) CPUs, $(echo "$bestLine" | sed -n 's/.*(\(.* build\)).*/\1/p')"
+        printf "%s" "$results"
+    } > "$BASELINE"
+    echo "updated $BASELINE"
+fi
+
+[ -z "$failed" ]
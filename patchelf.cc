@@ -1,5 +1,10 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <cassert>
@@ -8,9 +13,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <numeric>
 
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -24,7 +36,9 @@
 
 static std::vector<std::string> fileNames;
 static std::string outputFileName;
+static std::string traceFileName;
 static bool alwaysWrite = true;
+static bool clobberOldSections = true;
 
 #ifdef DEFAULT_PAGESIZE
 static int forcedPageSize = DEFAULT_PAGESIZE;
@@ -32,6 +46,158 @@ static int forcedPageSize = DEFAULT_PAGESIZE;
 static int forcedPageSize = -1;
 #endif
 
+struct SysError : std::runtime_error
+{
+    int errNo;
+    explicit SysError(const std::string & msg)
+        : std::runtime_error(msg + ": " + strerror(errno))
+        , errNo(errno)
+    { }
+};
+
+[[noreturn]] static void error(const std::string & msg)
+{
+    if (errno)
+        throw SysError(msg);
+    throw std::runtime_error(msg);
+}
+
+static void checkPointer(const FileContents & contents, const void * p, size_t size)
+{
+    auto q = static_cast<const unsigned char *>(p);
+    if (q < contents->data() || size > contents->size() || q > contents->data() + contents->size() - size)
+        error("data region extends past file end");
+}
+
+/* A token bucket shared by all worker threads.  Acquiring more tokens than
+   are available puts the bucket into debt and sleeps until it is paid off,
+   so large requests are throttled without having to be split up. */
+class TokenBucket {
+public:
+    void setRate(double perSecond) noexcept {
+        rate = tokens = perSecond;
+        last = std::chrono::steady_clock::now();
+    }
+
+    [[nodiscard]] bool enabled() const noexcept { return rate > 0; }
+
+    void acquire(double n) {
+        if (!enabled()) return;
+
+        std::chrono::duration<double> wait;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            /* Allow bursts of at most one second worth of tokens. */
+            tokens = std::min(rate, tokens + rate * std::chrono::duration<double>(now - last).count());
+            last = now;
+            tokens -= n;
+            if (tokens >= 0) return;
+            wait = std::chrono::duration<double>(-tokens / rate);
+        }
+        std::this_thread::sleep_for(wait);
+    }
+
+private:
+    std::mutex mutex;
+    double rate = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+};
+
+static TokenBucket readBandwidth, writeBandwidth, ioOperations;
+
+/* When I/O is rate limited, files are transferred in chunks of this size
+   so that the limit is enforced smoothly. */
+static constexpr size_t ioChunkSize = 1 << 20;
+
+static bool ioLimited() noexcept {
+    return readBandwidth.enabled() || writeBandwidth.enabled() || ioOperations.enabled();
+}
+
+static bool lowPriority = false;
+
+/* Lower the CPU and I/O priority of the calling thread (on Linux both are
+   per-thread attributes) so that patching doesn't disturb co-located
+   services. */
+static void applyLowPriority() {
+    if (!lowPriority) return;
+
+    pid_t tid = syscall(SYS_gettid);
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0)
+        warn("cannot lower the CPU priority: %s\n", strerror(errno));
+#ifdef SYS_ioprio_set
+    /* IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0) for IOPRIO_WHO_PROCESS. */
+    const int ioprioWhoProcess = 1, ioprioClassIdle = 3, ioprioClassShift = 13;
+    if (syscall(SYS_ioprio_set, ioprioWhoProcess, tid, ioprioClassIdle << ioprioClassShift) != 0)
+        warn("cannot lower the I/O priority: %s\n", strerror(errno));
+#endif
+}
+
+/* Recycles file buffers across the files of a batch.  Besides saving the
+   allocation, a recycled buffer already has its pages mapped, whereas a
+   fresh multi-megabyte one page-faults on every first touch.  Buffers
+   above maxRetained are freed instead, so that one huge input doesn't pin
+   its memory for the rest of the batch.  A new buffer gets 'headroom'
+   bytes of spare capacity: appending the replaced sections or shifting
+   an executable by a few pages then grows it in place, instead of
+   reallocating and copying the whole file (which would need twice its
+   size in memory).  The spare pages are never touched unless used. */
+class BufferPool {
+public:
+    /* The returned buffer has 'size' bytes of unspecified content. */
+    FileContents acquire(size_t size) {
+        std::unique_ptr<std::vector<unsigned char>> buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            /* Best fit: the smallest buffer that is large enough, or
+               else the largest one, which will have to grow. */
+            auto best = free.end();
+            for (auto i = free.begin(); i != free.end(); ++i) {
+                bool fits = (*i)->capacity() >= size;
+                if (best == free.end()
+                    || (fits && ((*best)->capacity() < size || (*i)->capacity() < (*best)->capacity()))
+                    || (!fits && (*best)->capacity() < size && (*i)->capacity() > (*best)->capacity()))
+                    best = i;
+            }
+            if (best != free.end()) {
+                buffer = std::move(*best);
+                free.erase(best);
+            }
+        }
+        if (!buffer)
+            buffer = std::make_unique<std::vector<unsigned char>>();
+        if (buffer->capacity() < size)
+            buffer->reserve(size + headroom);
+
+        /* Only bytes beyond the previous size get zeroed here; the caller
+           overwrites everything anyway. */
+        buffer->resize(size);
+        return FileContents(buffer.release(), [this](std::vector<unsigned char> * b) { release(b); });
+    }
+
+    void setCapacity(size_t n) noexcept { capacity = n; }
+
+    static constexpr size_t maxRetained = 64 << 20;
+    static constexpr size_t headroom = 1 << 20;
+
+private:
+    void release(std::vector<unsigned char> * buffer) {
+        std::unique_ptr<std::vector<unsigned char>> owned(buffer);
+        if (owned->capacity() > maxRetained)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free.size() < capacity)
+            free.push_back(std::move(owned));
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::vector<unsigned char>>> free;
+    size_t capacity = 1;
+};
+
+static BufferPool bufferPool;
+
 static FileContents readFile(
 	const std::string & fileName,
     size_t cutOff = std::numeric_limits<size_t>::max()
@@ -45,20 +211,31 @@ static FileContents readFile(
 
     size_t size = std::min(cutOff, static_cast<size_t>(st.st_size));
 
-    FileContents contents = std::make_shared<std::vector<unsigned char>>(size);
+    FileContents contents = bufferPool.acquire(size);
 
     int fd = open(fileName.c_str(), O_RDONLY);
     if (fd == -1) return FileContents();
 
+    bool limited = ioLimited();
     size_t bytesRead = 0;
     ssize_t portion;
-    while ((portion = read(fd, contents->data() + bytesRead, size - bytesRead)) > 0)
+    while (bytesRead < size) {
+        size_t chunk = limited ? std::min(size - bytesRead, ioChunkSize) : size - bytesRead;
+        if (limited) {
+            ioOperations.acquire(1);
+            readBandwidth.acquire(chunk);
+        }
+        if ((portion = read(fd, contents->data() + bytesRead, chunk)) <= 0)
+            break;
         bytesRead += portion;
+    }
 
     close(fd);
 
     if (bytesRead != size) return FileContents();
 
+    fileStats.bytesRead += bytesRead;
+
     return contents;
 }
 
@@ -89,6 +266,30 @@ typedef struct {
 }
 
 
+/* The parts of an Elf_Versym entry. */
+static const unsigned int versymVersion = 0x7fff;
+static const unsigned int versymHidden = 0x8000;
+
+/* The hash function of DT_GNU_HASH. */
+static uint32_t gnuHash(std::string_view name) {
+    uint32_t h = 5381;
+    for (unsigned char c : name)
+        h = h * 33 + c;
+    return h;
+}
+
+/* The hash function of DT_HASH. */
+static uint32_t sysvHash(std::string_view name) {
+    uint32_t h = 0;
+    for (unsigned char c : name) {
+        h = (h << 4) + c;
+        uint32_t g = h & 0xf0000000;
+        h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
 static std::string extractString(const FileContents & contents, size_t offset, size_t size) {
     return { reinterpret_cast<const char *>(contents->data()) + offset, size };
 }
@@ -98,6 +299,17 @@ template<ElfFileParams>
 ElfFile<ElfFileParamNames>::ElfFile(
 	FileContents fContents
 ) : fileContents(fContents) {
+    PhaseTimer timer(Phase::Parse);
+    TraceSpan span("parse");
+
+    phdrs.swap(scratch.phdrs);
+    phdrs.clear();
+    shdrs.swap(scratch.shdrs);
+    shdrs.clear();
+    sectionNames.swap(scratch.sectionNames);
+    sectionsByOldIndex.swap(scratch.sectionsByOldIndex);
+    sectionIndexes.swap(scratch.sectionIndexes);
+
     /* Check the ELF header for basic validity. */
     if (fileContents->size() < (off_t) sizeof(Elf_Ehdr)) error("missing ELF header");
 
@@ -123,20 +335,14 @@ ElfFile<ElfFileParamNames>::ElfFile(
         }
     }
 
-    if (rdi(hdr()->e_shnum) == 0)
-        error("no section headers. The input file is probably a statically linked, self-decompressing binary");
-
-    {
-        auto sh_offset = rdi(hdr()->e_shoff);
-        auto sh_num = rdi(hdr()->e_shnum);
-        auto sh_entsize = rdi(hdr()->e_shentsize);
-        size_t sh_size, sh_end;
-
-        if (__builtin_mul_overflow(sh_num, sh_entsize, &sh_size)
-            || __builtin_add_overflow(sh_offset, sh_size, &sh_end)
-            || sh_end > fileContents->size()) {
-            error("section header table out of bounds");
-        }
+    /* With extended section numbering (more than SHN_LORESERVE
+       sections), e_shnum is zero and the real count lives in the
+       sh_size field of section 0. */
+    size_t sh_num = rdi(hdr()->e_shnum);
+    if (sh_num == 0 && rdi(hdr()->e_shoff) != 0) {
+        auto shdr0 = (const Elf_Shdr *) (fileContents->data() + rdi(hdr()->e_shoff));
+        checkPointer(fileContents, shdr0, sizeof(*shdr0));
+        sh_num = rdi(shdr0->sh_size);
     }
 
     if (rdi(hdr()->e_phentsize) != sizeof(Elf_Phdr))
@@ -151,17 +357,46 @@ ElfFile<ElfFileParamNames>::ElfFile(
         if (rdi(phdrs[i].p_type) == PT_INTERP) isExecutable = true;
     }
 
-    for (int i = 0; i < rdi(hdr()->e_shnum); ++i) {
+    /* Files stripped of their section headers (e.g. by sstrip) can
+       still be patched in place through the dynamic segment; see
+       replaceNeededInPlace(). */
+    if (sh_num == 0) {
+        sectionNames.clear();
+        sectionsByOldIndex.clear();
+        sectionIndexes.clear();
+        trackMemory(MemCategory::Names, 0);
+        accountMemory();
+        return;
+    }
+
+    {
+        auto sh_offset = rdi(hdr()->e_shoff);
+        auto sh_entsize = rdi(hdr()->e_shentsize);
+        size_t sh_size, sh_end;
+
+        if (__builtin_mul_overflow(sh_num, sh_entsize, &sh_size)
+            || __builtin_add_overflow(sh_offset, sh_size, &sh_end)
+            || sh_end > fileContents->size()) {
+            error("section header table out of bounds");
+        }
+    }
+
+    shdrs.reserve(sh_num);
+    for (size_t i = 0; i < sh_num; ++i) {
         Elf_Shdr *shdr = (Elf_Shdr *) (fileContents->data() + rdi(hdr()->e_shoff)) + i;
 
         checkPointer(fileContents, shdr, sizeof(*shdr));
         shdrs.push_back(*shdr);
     }
+    fileStats.sections += sh_num;
 
     /* Get the section header string table section (".shstrtab").  Its
        index in the section header table is given by e_shstrndx field
-       of the ELF header. */
-    auto shstrtabIndex = rdi(hdr()->e_shstrndx);
+       of the ELF header, or by sh_link of section 0 if that is
+       SHN_XINDEX. */
+    size_t shstrtabIndex = rdi(hdr()->e_shstrndx);
+    if (shstrtabIndex == SHN_XINDEX)
+        shstrtabIndex = rdi(shdrs[0].sh_link);
     if (shstrtabIndex >= shdrs.size())
         error("string table index out of bounds");
 
@@ -178,11 +413,44 @@ ElfFile<ElfFileParamNames>::ElfFile(
     if (shstrtab[shstrtabSize - 1] != 0)
         error("string table is not zero terminated");
 
-    sectionNames = std::string(shstrtab, shstrtabSize);
+    sectionNames.assign(shstrtab, shstrtabSize);
 
+    /* Assign rather than construct the names so that strings recycled from
+       the previous file keep their buffers. */
     sectionsByOldIndex.resize(shdrs.size());
+    sectionsByOldIndex.at(0).clear();
     for (size_t i = 1; i < shdrs.size(); ++i)
-        sectionsByOldIndex.at(i) = getSectionName(shdrs.at(i));
+        sectionsByOldIndex.at(i).assign(getSectionNameView(shdrs.at(i)));
+
+    sectionIndexes.resize(shdrs.size());
+    std::iota(sectionIndexes.begin(), sectionIndexes.end(), 0);
+
+    uint64_t names = sectionNames.capacity() + sectionsByOldIndex.capacity() * sizeof(SectionName);
+    for (auto & name : sectionsByOldIndex)
+        names += name.capacity();
+    trackMemory(MemCategory::Names, names);
+    accountMemory();
+}
+
+template<ElfFileParams>
+ElfFile<ElfFileParamNames>::~ElfFile() {
+    scratch.phdrs.swap(phdrs);
+    scratch.shdrs.swap(shdrs);
+    scratch.sectionNames.swap(sectionNames);
+    scratch.sectionsByOldIndex.swap(sectionsByOldIndex);
+    scratch.sectionIndexes.swap(sectionIndexes);
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::accountMemory() const {
+    trackMemory(MemCategory::File, fileContents->size());
+    trackMemory(MemCategory::Headers,
+        phdrs.capacity() * sizeof(Elf_Phdr) + shdrs.capacity() * sizeof(Elf_Shdr));
+
+    uint64_t sections = 0;
+    for (auto & i : replacedSections)
+        sections += i.first.capacity() + i.second.capacity();
+    trackMemory(MemCategory::Sections, sections);
 }
 
 template<ElfFileParams>
@@ -212,72 +480,117 @@ unsigned int ElfFile<ElfFileParamNames>::getPageSize() const noexcept {
     }
 }
 
+template<ElfFileParams>
+template<class Hdr, class Less>
+void ElfFile<ElfFileParamNames>::sortBy(std::vector<Hdr> & hdrs, std::vector<Hdr> & sorted, size_t first, Less less) {
+    auto & order = scratch.order;
+    order.resize(hdrs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin() + first, order.end(), less);
+
+    sorted.resize(hdrs.size());
+    for (size_t i = 0; i < hdrs.size(); ++i)
+        sorted[i] = hdrs[order[i]];
+    hdrs.swap(sorted);
+}
+
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::sortPhdrs() {
-    /* Sort the segments by offset. */
-    CompPhdr comp;
-    comp.elfFile = this;
-    stable_sort(phdrs.begin(), phdrs.end(), comp);
+    /* Sort the segments by offset, except that a PHDR comes before
+       everything else. */
+    sortBy(phdrs, scratch.sortedPhdrs, 0, [&](unsigned int x, unsigned int y) {
+        if (rdi(phdrs[y].p_type) == PT_PHDR) return false;
+        if (rdi(phdrs[x].p_type) == PT_PHDR) return true;
+        return rdi(phdrs[x].p_offset) < rdi(phdrs[y].p_offset);
+    });
 }
 
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::sortShdrs() {
-    /* Translate sh_link mappings to section names, since sorting the
-       sections will invalidate the sh_link fields. */
-    std::map<SectionName, SectionName> linkage;
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_link) != 0)
-            linkage[getSectionName(shdrs.at(i))] = getSectionName(shdrs.at(rdi(shdrs.at(i).sh_link)));
-
-    /* Idem for sh_info on certain sections. */
-    std::map<SectionName, SectionName> info;
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_info) != 0 &&
-            (rdi(shdrs.at(i).sh_type) == SHT_REL || rdi(shdrs.at(i).sh_type) == SHT_RELA))
-            info[getSectionName(shdrs.at(i))] = getSectionName(shdrs.at(rdi(shdrs.at(i).sh_info)));
-
-    /* Idem for the index of the .shstrtab section in the ELF header. */
-    Elf_Shdr shstrtab = shdrs.at(rdi(hdr()->e_shstrndx));
+    PhaseTimer timer(Phase::Sort);
 
     /* Sort the sections by offset. */
-    CompShdr comp;
-    comp.elfFile = this;
-    stable_sort(shdrs.begin() + 1, shdrs.end(), comp);
-
-    /* Restore the sh_link mappings. */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_link) != 0)
-            wri(shdrs[i].sh_link,
-                getSectionIndex(linkage[getSectionName(shdrs[i])]));
+    sortBy(shdrs, scratch.sortedShdrs, 1, [&](unsigned int x, unsigned int y) {
+        return rdi(shdrs[x].sh_offset) < rdi(shdrs[y].sh_offset);
+    });
+
+    /* Sorting invalidates every reference to a section by index.  sortBy()
+       left the permutation in scratch.order (new index -> old index);
+       invert it to translate the references.  Unlike matching sections
+       by name, this is unambiguous when several sections share a name. */
+    auto & order = scratch.order;
+    auto & newIndex = scratch.inverseOrder;
+    newIndex.resize(order.size());
+    for (unsigned int i = 0; i < order.size(); ++i)
+        newIndex[order[i]] = i;
+
+    auto remap = [&](auto & field, const char * what) {
+        auto old = rdi(field);
+        if (old >= newIndex.size())
+            error(std::string("section ") + what + " out of bounds");
+        wri(field, newIndex[old]);
+    };
+
+    for (unsigned int i = 1; i < shdrs.size(); ++i) {
+        auto & shdr = shdrs[i];
+        if (rdi(shdr.sh_link) != 0)
+            remap(shdr.sh_link, "sh_link");
+        /* sh_info is a section index only for relocation sections. */
+        if (rdi(shdr.sh_info) != 0 &&
+            (rdi(shdr.sh_type) == SHT_REL || rdi(shdr.sh_type) == SHT_RELA))
+            remap(shdr.sh_info, "sh_info");
+    }
 
-    /* And the st_info mappings. */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_info) != 0 &&
-            (rdi(shdrs.at(i).sh_type) == SHT_REL || rdi(shdrs.at(i).sh_type) == SHT_RELA))
-            wri(shdrs.at(i).sh_info,
-                getSectionIndex(info.at(getSectionName(shdrs.at(i)))));
+    /* The string table index and the section count only fit in the ELF
+       header below SHN_LORESERVE; beyond, the header holds SHN_XINDEX
+       (resp. 0) and the value goes to section 0. */
+    bool xindex = rdi(hdr()->e_shstrndx) == SHN_XINDEX;
+    size_t shstrndx = xindex ? rdi(shdrs[0].sh_link) : rdi(hdr()->e_shstrndx);
+    if (shstrndx >= newIndex.size())
+        error("section string table index out of bounds");
+    shstrndx = newIndex[shstrndx];
+    if (shstrndx >= SHN_LORESERVE) {
+        wri(hdr()->e_shstrndx, SHN_XINDEX);
+        wri(shdrs[0].sh_link, shstrndx);
+    } else {
+        wri(hdr()->e_shstrndx, shstrndx);
+        if (xindex) wri(shdrs[0].sh_link, 0);
+    }
 
-    /* And the .shstrtab index. Note: the match here is done by checking the offset as searching
-     * by name can yield incorrect results in case there are multiple sections with the same
-     * name as the one initially pointed by hdr()->e_shstrndx */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
-        if (shdrs.at(i).sh_offset == shstrtab.sh_offset) {
-            wri(hdr()->e_shstrndx, i);
-        }
+    if (shdrs.size() >= SHN_LORESERVE) {
+        wri(hdr()->e_shnum, 0);
+        wri(shdrs[0].sh_size, shdrs.size());
+    } else {
+        wri(hdr()->e_shnum, shdrs.size());
+        wri(shdrs[0].sh_size, 0);
     }
+
+    for (auto & i : sectionIndexes)
+        i = newIndex[i];
 }
 
 static void writeFile(const std::string & fileName, const FileContents & contents) {
+    PhaseTimer timer(Phase::Write);
+    TraceSpan span("write");
+    span.arg("size", contents->size());
+
     debug("writing %s\n", fileName.c_str());
 
     int fd = open(fileName.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0777);
     if (fd == -1)
         error("open");
 
+    bool limited = ioLimited();
     size_t bytesWritten = 0;
     ssize_t portion;
     while (bytesWritten < contents->size()) {
-        if ((portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten)) < 0) {
+        size_t chunk = contents->size() - bytesWritten;
+        if (limited) {
+            chunk = std::min(chunk, ioChunkSize);
+            ioOperations.acquire(1);
+            writeBandwidth.acquire(chunk);
+        }
+        if ((portion = write(fd, contents->data() + bytesWritten, chunk)) < 0) {
             if (errno == EINTR)
                 continue;
             error("write");
@@ -285,6 +598,8 @@ static void writeFile(const std::string & fileName, const FileContents & content
         bytesWritten += portion;
     }
 
+    fileStats.bytesWritten += bytesWritten;
+
     if (close(fd) >= 0)
         return;
     /*
@@ -306,26 +621,64 @@ static uint64_t roundUp(uint64_t n, uint64_t m) {
     return ((n - 1) / m + 1) * m;
 }
 
+/* Sections or segments (by index) sorted by file offset, to find those
+   starting within a range of offsets by binary search instead of scanning
+   all headers for every query. */
+class OffsetIndex {
+public:
+    using Entry = std::pair<uint64_t, unsigned int>;
+    using Iterator = std::vector<Entry>::const_iterator;
+
+    void add(uint64_t offset, unsigned int index) {
+        entries.emplace_back(offset, index);
+        sorted = false;
+    }
+
+    /* The entries starting in [begin, end), in offset order. */
+    [[nodiscard]] std::pair<Iterator, Iterator> range(uint64_t begin, uint64_t end) {
+        if (!sorted) {
+            std::sort(entries.begin(), entries.end());
+            sorted = true;
+        }
+        return { std::lower_bound(entries.cbegin(), entries.cend(), Entry(begin, 0)),
+                 std::lower_bound(entries.cbegin(), entries.cend(), Entry(end, 0)) };
+    }
+
+private:
+    std::vector<Entry> entries;
+    bool sorted = true;
+};
+
 template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t startOffset, size_t extraBytes) {
+void ElfFile<ElfFileParamNames>::shiftFile(size_t extraPages, size_t startOffset, size_t extraBytes) {
+    PhaseTimer timer(Phase::Shift);
+
     assert(startOffset >= sizeof(Elf_Ehdr));
 
     auto oldSize = fileContents->size();
     assert(oldSize > startOffset);
 
     /* Move the entire contents of the file after 'startOffset' by 'extraPages' pages further. */
-    unsigned int shift = extraPages * getPageSize();
+    size_t shift, newSize;
+    if (__builtin_mul_overflow(extraPages, getPageSize(), &shift)
+        || __builtin_add_overflow(oldSize, shift, &newSize)
+        || newSize > std::numeric_limits<Elf_Off>::max())
+        error("file too large to shift by " + std::to_string(extraPages) + " pages");
     fileContents->resize(oldSize + shift, 0);
     memmove(fileContents->data() + startOffset + shift, fileContents->data() + startOffset, oldSize - startOffset);
     memset(fileContents->data() + startOffset, 0, shift);
 
+    fileStats.pageShifts++;
+    fileStats.bytesMoved += oldSize - startOffset;
+    fileStats.bytesZeroed += 2 * (uint64_t) shift;
+
     /* Adjust the ELF header. */
     wri(hdr()->e_phoff, sizeof(Elf_Ehdr));
     if (rdi(hdr()->e_shoff) >= startOffset)
         wri(hdr()->e_shoff, rdi(hdr()->e_shoff) + shift);
 
     /* Update the offsets in the section headers. */
-    for (int i = 1; i < rdi(hdr()->e_shnum); ++i) {
+    for (size_t i = 1; i < shdrs.size(); ++i) {
         size_t sh_offset = rdi(shdrs.at(i).sh_offset);
         if (sh_offset >= startOffset)
             wri(shdrs.at(i).sh_offset, sh_offset + shift);
@@ -358,8 +711,8 @@ void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t start
             wri(phdrs.at(i).p_offset, p_start + shift);
             if (rdi(phdrs.at(i).p_align) != 0 &&
                 (rdi(phdrs.at(i).p_vaddr) - rdi(phdrs.at(i).p_offset)) % rdi(phdrs.at(i).p_align) != 0) {
-                debug("changing alignment of program header %d from %d to %d\n", i,
-                    rdi(phdrs.at(i).p_align), getPageSize());
+                debug("changing alignment of program header %d from %llu to %u\n", i,
+                    (unsigned long long) rdi(phdrs.at(i).p_align), getPageSize());
                 wri(phdrs.at(i).p_align, getPageSize());
             }
         } else {
@@ -378,22 +731,30 @@ void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t start
     wri(hdr()->e_phnum, rdi(hdr()->e_phnum) + 1);
     Elf_Phdr & phdr = phdrs.at(rdi(hdr()->e_phnum) - 1);
     wri(phdr.p_type, PT_LOAD);
-    wri(phdr.p_offset, phdrs.at(splitIndex).p_offset - splitShift - shift);
-    wri(phdr.p_paddr, phdrs.at(splitIndex).p_paddr - splitShift - shift);
-    wri(phdr.p_vaddr, phdrs.at(splitIndex).p_vaddr - splitShift - shift);
+    wri(phdr.p_offset, rdi(phdrs.at(splitIndex).p_offset) - splitShift - shift);
+    wri(phdr.p_paddr, rdi(phdrs.at(splitIndex).p_paddr) - splitShift - shift);
+    wri(phdr.p_vaddr, rdi(phdrs.at(splitIndex).p_vaddr) - splitShift - shift);
     wri(phdr.p_filesz, wri(phdr.p_memsz, splitShift + extraBytes));
     wri(phdr.p_flags, PF_R | PF_W);
     wri(phdr.p_align, getPageSize());
+
+    fileStats.newLoadSegments++;
+    accountMemory();
 }
 
 template<ElfFileParams>
-std::string ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr) const {
+std::string_view ElfFile<ElfFileParamNames>::getSectionNameView(const Elf_Shdr & shdr) const {
     const size_t name_off = rdi(shdr.sh_name);
 
     if (name_off >= sectionNames.size())
         error("section name offset out of bounds");
 
-    return std::string(sectionNames.c_str() + name_off);
+    return std::string_view(sectionNames.c_str() + name_off);
+}
+
+template<ElfFileParams>
+std::string ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr) const {
+    return std::string(getSectionNameView(shdr));
 }
 
 template<ElfFileParams>
@@ -438,8 +799,13 @@ span<T> ElfFile<ElfFileParamNames>::tryGetSectionSpan(const SectionName & sectio
 
 template<ElfFileParams>
 unsigned int ElfFile<ElfFileParamNames>::getSectionIndex(const SectionName & sectionName) const {
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (getSectionName(shdrs.at(i)) == sectionName) return i;
+    fileStats.sectionLookups++;
+    for (unsigned int i = 1; i < shdrs.size(); ++i)
+        if (getSectionNameView(shdrs.at(i)) == sectionName) {
+            fileStats.sectionsScanned += i;
+            return i;
+        }
+    fileStats.sectionsScanned += shdrs.size();
     return 0;
 }
 
@@ -458,24 +824,31 @@ bool ElfFile<ElfFileParamNames>::canReplaceSection(const SectionName & sectionNa
 template<ElfFileParams>
 std::string & ElfFile<ElfFileParamNames>::replaceSection(
 	const SectionName & sectionName,
-    unsigned int size
+    size_t size
 ) {
     auto i = replacedSections.find(sectionName);
-    std::string s;
 
-    if (i != replacedSections.end()) {
-        s = std::string(i->second);
-    } else {
+    if (i == replacedSections.end()) {
         auto shdr = findSectionHeader(sectionName);
-        s = extractString(fileContents, rdi(shdr.sh_offset), rdi(shdr.sh_size));
+        i = replacedSections.emplace(sectionName,
+            extractString(fileContents, rdi(shdr.sh_offset), rdi(shdr.sh_size))).first;
     }
 
-    s.resize(size);
-    replacedSections[sectionName] = s;
+    i->second.resize(size);
+    accountMemory();
 
-    return replacedSections[sectionName];
+    return i->second;
 }
 
+/* Sections that are mapped by a segment of their own, which must be moved
+   along with them. */
+static const std::pair<const char *, unsigned int> sectionSegments[] = {
+    { ".interp", PT_INTERP },
+    { ".dynamic", PT_DYNAMIC },
+    { ".MIPS.abiflags", PT_MIPS_ABIFLAGS },
+    { ".note.gnu.property", PT_GNU_PROPERTY },
+};
+
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::writeReplacedSections(
 	Elf_Off & curOff,
@@ -494,6 +867,25 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(
         }
     }
 
+    /* Find the segments that may have to follow a replaced section in a
+       single pass over the program headers. */
+    std::vector<std::pair<unsigned int, unsigned int>> syncedPhdrs; /* (sectionSegments index, phdr index) */
+    std::vector<unsigned int> notePhdrs;
+    for (unsigned int j = 0; j < phdrs.size(); ++j) {
+        auto type = rdi(phdrs[j].p_type);
+        if (type == PT_NOTE)
+            notePhdrs.push_back(j);
+        for (unsigned int k = 0; k < std::size(sectionSegments); ++k)
+            if (type == sectionSegments[k].second)
+                syncedPhdrs.emplace_back(k, j);
+    }
+
+    auto syncSegment = [](Elf_Phdr & phdr, const Elf_Shdr & shdr) {
+        phdr.p_offset = shdr.sh_offset;
+        phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
+        phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
+    };
+
     std::set<unsigned int> noted_phdrs = {};
 
     /* We iterate over the sorted section headers here, so that the relative
@@ -505,11 +897,13 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(
             continue;
 
         Elf_Shdr orig_shdr = shdr;
-        debug("rewriting section '%s' from offset 0x%x (size %d) to offset 0x%x (size %d)\n",
-            sectionName.c_str(), rdi(shdr.sh_offset), rdi(shdr.sh_size), curOff, i->second.size());
+        debug("rewriting section '%s' from offset 0x%llx (size %llu) to offset 0x%llx (size %zu)\n",
+            sectionName.c_str(), (unsigned long long) rdi(shdr.sh_offset), (unsigned long long) rdi(shdr.sh_size),
+            (unsigned long long) curOff, i->second.size());
 
         memcpy(fileContents->data() + curOff, i->second.c_str(),
             i->second.size());
+        fileStats.bytesMoved += i->second.size();
 
         /* Update the section header for this section. */
         wri(shdr.sh_offset, curOff);
@@ -517,29 +911,11 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(
         wri(shdr.sh_size, i->second.size());
         wri(shdr.sh_addralign, sectionAlignment);
 
-        /* If this is the .interp section, then the PT_INTERP segment
-           must be sync'ed with it. */
-        if (sectionName == ".interp") {
-            for (auto & phdr : phdrs) {
-                if (rdi(phdr.p_type) == PT_INTERP) {
-                    phdr.p_offset = shdr.sh_offset;
-                    phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
-                    phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
-                }
-            }
-        }
-
-        /* If this is the .dynamic section, then the PT_DYNAMIC segment
+        /* If this is e.g. the .interp section, then the PT_INTERP segment
            must be sync'ed with it. */
-        else if (sectionName == ".dynamic") {
-            for (auto & phdr : phdrs) {
-                if (rdi(phdr.p_type) == PT_DYNAMIC) {
-                    phdr.p_offset = shdr.sh_offset;
-                    phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
-                    phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
-                }
-            }
-        }
+        for (auto & [k, j] : syncedPhdrs)
+            if (sectionName == sectionSegments[k].first)
+                syncSegment(phdrs[j], shdr);
 
         /* If this is a note section, there might be a PT_NOTE segment that
            must be sync'ed with it. Note that normalizeNoteSegments() will have
@@ -554,9 +930,9 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(
             if (orig_shdr.sh_addralign < sectionAlignment)
                 shdr.sh_addralign = orig_shdr.sh_addralign;
 
-            for (unsigned int j = 0; j < phdrs.size(); ++j) {
+            for (unsigned int j : notePhdrs) {
                 auto &phdr = phdrs.at(j);
-                if (rdi(phdr.p_type) == PT_NOTE && !noted_phdrs.count(j)) {
+                if (!noted_phdrs.count(j)) {
                     Elf_Off p_start = rdi(phdr.p_offset);
                     Elf_Off p_end = p_start + rdi(phdr.p_filesz);
                     Elf_Off s_start = rdi(orig_shdr.sh_offset);
@@ -571,39 +947,13 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(
                     if (p_start != s_start || p_end != s_end)
                         error("unsupported overlap of SHT_NOTE and PT_NOTE");
 
-                    phdr.p_offset = shdr.sh_offset;
-                    phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
-                    phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
+                    syncSegment(phdr, shdr);
 
                     noted_phdrs.insert(j);
                 }
             }
         }
 
-        /* If there is .MIPS.abiflags section, then the PT_MIPS_ABIFLAGS
-           segment must be sync'ed with it. */
-        if (sectionName == ".MIPS.abiflags") {
-            for (auto & phdr : phdrs) {
-                if (rdi(phdr.p_type) == PT_MIPS_ABIFLAGS) {
-                    phdr.p_offset = shdr.sh_offset;
-                    phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
-                    phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
-                }
-            }
-        }
-
-        /* If there is .note.gnu.property section, then the PT_GNU_PROPERTY
-           segment must be sync'ed with it. */
-        if (sectionName == ".note.gnu.property") {
-            for (auto & phdr : phdrs) {
-                if (rdi(phdr.p_type) == PT_GNU_PROPERTY) {
-                    phdr.p_offset = shdr.sh_offset;
-                    phdr.p_vaddr = phdr.p_paddr = shdr.sh_addr;
-                    phdr.p_filesz = phdr.p_memsz = shdr.sh_size;
-                }
-            }
-        }
-
         curOff += roundUp(i->second.size(), sectionAlignment);
     }
 
@@ -619,12 +969,12 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
        page of other segments. */
     Elf_Addr startPage = 0;
     Elf_Addr firstPage = 0;
-    unsigned alignStartPage = getPageSize();
+    uint64_t alignStartPage = getPageSize();
     for (auto & phdr : phdrs) {
         Elf_Addr thisPage = rdi(phdr.p_vaddr) + rdi(phdr.p_memsz);
         if (thisPage > startPage) startPage = thisPage;
         if (rdi(phdr.p_type) == PT_PHDR) firstPage = rdi(phdr.p_vaddr) - rdi(phdr.p_offset);
-        unsigned thisAlign = rdi(phdr.p_align);
+        uint64_t thisAlign = rdi(phdr.p_align);
         alignStartPage = std::max(alignStartPage, thisAlign);
     }
 
@@ -642,7 +992,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
        assuming we're going to need one more to account for new PT_LOAD covering
        relocated PHDR */
     off_t phtSize = roundUp((phdrs.size() + num_notes + 1) * sizeof(Elf_Phdr) + sizeof(Elf_Ehdr), sectionAlignment);
-    off_t shtSize = roundUp(rdi(hdr()->e_shnum) * rdi(hdr()->e_shentsize), sectionAlignment);
+    off_t shtSize = roundUp(shdrs.size() * rdi(hdr()->e_shentsize), sectionAlignment);
 
     /* Check if we can keep PHT at the beginning of the file.
 
@@ -654,9 +1004,9 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
          PHDRs not located at the beginning of the file; it was fixed over
          0da1d5002745cdc721bc018b582a8a9704d56c42 (2022-03-02) */
     bool relocatePht = false;
-    unsigned int i = 1;
+    size_t i = 1;
 
-    while (i < rdi(hdr()->e_shnum) && ((off_t) rdi(shdrs.at(i).sh_offset)) <= phtSize) {
+    while (i < shdrs.size() && ((off_t) rdi(shdrs.at(i).sh_offset)) <= phtSize) {
         const auto & sectionName = getSectionName(shdrs.at(i));
 
         if (!hasReplacedSection(sectionName) && !canReplaceSection(sectionName)) {
@@ -667,10 +1017,13 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
         i++;
     }
 
+    if (relocatePht)
+        fileStats.relocatedPhts++;
+
     if (!relocatePht) {
-        unsigned int i = 1;
+        size_t i = 1;
 
-        while (i < rdi(hdr()->e_shnum) && ((off_t) rdi(shdrs.at(i).sh_offset)) <= phtSize) {
+        while (i < shdrs.size() && ((off_t) rdi(shdrs.at(i).sh_offset)) <= phtSize) {
             const auto & sectionName = getSectionName(shdrs.at(i));
             const auto sectionSize = rdi(shdrs.at(i).sh_size);
 
@@ -692,16 +1045,28 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
     for (auto & s : replacedSections)
         neededSpace += roundUp(s.second.size(), sectionAlignment);
 
-    debug("needed space is %d\n", neededSpace);
+    debug("needed space is %lld\n", (long long) neededSpace);
 
-    Elf_Off startOffset = roundUp(fileContents->size(), alignStartPage);
+    uint64_t alignedSize = roundUp(fileContents->size(), alignStartPage);
 
     // In older version of binutils (2.30), readelf would check if the dynamic
     // section segment is strictly smaller than the file (and not same size).
     // By making it one byte larger, we don't break readelf.
     off_t binutilsQuirkPadding = 1;
 
-    fileContents->resize(startOffset + neededSpace + binutilsQuirkPadding, 0);
+    /* The new sections must still be addressable by the (possibly 32-bit)
+       offsets of this ELF class. */
+    uint64_t newSize;
+    if (__builtin_add_overflow(alignedSize, neededSpace + binutilsQuirkPadding, &newSize)
+        || newSize > std::numeric_limits<Elf_Off>::max()
+        || newSize > std::numeric_limits<size_t>::max())
+        error("file too large to add " + std::to_string(neededSpace) + " bytes of sections");
+
+    Elf_Off startOffset = alignedSize;
+
+    fileStats.bytesZeroed += newSize - fileContents->size();
+    fileContents->resize(newSize, 0);
+    accountMemory();
 
     auto& lastSeg = phdrs.back();
     Elf_Addr lastSegAddr = 0;
@@ -739,6 +1104,8 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
         assert(startPage % alignStartPage == startOffset % alignStartPage);
 
         lastSegAddr = startPage;
+        fileStats.newLoadSegments++;
+        accountMemory();
     }
 
     normalizeNoteSegments();
@@ -747,8 +1114,8 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
     Elf_Off curOff = startOffset;
 
     if (relocatePht) {
-        debug("rewriting pht from offset 0x%x to offset 0x%x (size %d)\n",
-            rdi(hdr()->e_phoff), curOff, phtSize);
+        debug("rewriting pht from offset 0x%llx to offset 0x%llx (size %lld)\n",
+            (unsigned long long) rdi(hdr()->e_phoff), (unsigned long long) curOff, (long long) phtSize);
 
         wri(hdr()->e_phoff, curOff);
         curOff += phtSize;
@@ -756,8 +1123,8 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary() {
 
     // ---
 
-    debug("rewriting sht from offset 0x%x to offset 0x%x (size %d)\n",
-        rdi(hdr()->e_shoff), curOff, shtSize);
+    debug("rewriting sht from offset 0x%llx to offset 0x%llx (size %lld)\n",
+        (unsigned long long) rdi(hdr()->e_shoff), (unsigned long long) curOff, (long long) shtSize);
 
     wri(hdr()->e_shoff, curOff);
     curOff += shtSize;
@@ -788,7 +1155,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
 
     /* What is the index of the last replaced section? */
     unsigned int lastReplaced = 0;
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
+    for (unsigned int i = 1; i < shdrs.size(); ++i) {
         std::string sectionName = getSectionName(shdrs.at(i));
         if (replacedSections.count(sectionName)) {
             debug("using replaced section '%s'\n", sectionName.c_str());
@@ -829,7 +1196,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
         prevSection = std::move(sectionName);
     }
 
-    debug("first reserved offset/addr is 0x%x/0x%llx\n",
+    debug("first reserved offset/addr is 0x%zx/0x%llx\n",
         startOffset, (unsigned long long) startAddr);
 
     assert(startAddr % getPageSize() == startOffset % getPageSize());
@@ -841,15 +1208,18 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
            overwritten by the replaced sections. Move them to the end of the file
            before proceeding. */
         off_t shoffNew = fileContents->size();
-        off_t shSize = rdi(hdr()->e_shoff) + rdi(hdr()->e_shnum) * rdi(hdr()->e_shentsize);
+        off_t shSize = rdi(hdr()->e_shoff) + shdrs.size() * rdi(hdr()->e_shentsize);
         fileContents->resize(fileContents->size() + shSize, 0);
+        fileStats.bytesZeroed += shSize;
+        accountMemory();
         wri(hdr()->e_shoff, shoffNew);
 
         /* Rewrite the section header table.  For neatness, keep the
-           sections sorted. */
-        assert(rdi(hdr()->e_shnum) == shdrs.size());
+           sections sorted.  Section 0 is written too, since it carries
+           the section count and string table index of files using
+           extended section numbering. */
         sortShdrs();
-        for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
+        for (size_t i = 0; i < shdrs.size(); ++i)
             * ((Elf_Shdr *) (fileContents->data() + rdi(hdr()->e_shoff)) + i) = shdrs.at(i);
     }
 
@@ -863,7 +1233,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
     for (auto & i : replacedSections)
         neededSpace += roundUp(i.second.size(), sectionAlignment);
 
-    debug("needed space is %d\n", neededSpace);
+    debug("needed space is %zu\n", neededSpace);
 
     /* If we need more space at the start of the file, then grow the
        file by the minimum number of pages and adjust internal
@@ -871,21 +1241,24 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
     if (neededSpace > startOffset) {
         /* We also need an additional program header, so adjust for that. */
         neededSpace += sizeof(Elf_Phdr);
-        debug("needed space is %d\n", neededSpace);
+        debug("needed space is %zu\n", neededSpace);
 
         /* Calculate how many bytes are needed out of the additional pages. */
         size_t extraSpace = neededSpace - startOffset; 
         // Always give one extra page to avoid colliding with segments that start at
         // unaligned addresses and will be rounded down when loaded
-        unsigned int neededPages = 1 + roundUp(extraSpace, getPageSize()) / getPageSize();
-        debug("needed pages is %d\n", neededPages);
-        if (neededPages * getPageSize() > firstPage)
+        size_t neededPages = 1 + roundUp(extraSpace, getPageSize()) / getPageSize();
+        debug("needed pages is %zu\n", neededPages);
+        size_t shift;
+        if (__builtin_mul_overflow(neededPages, getPageSize(), &shift))
+            error("cannot shift the file by " + std::to_string(neededPages) + " pages");
+        if (shift > firstPage)
             error("virtual address space underrun!");
 
         shiftFile(neededPages, startOffset, extraSpace);
 
-        firstPage -= neededPages * getPageSize();
-        startOffset += neededPages * getPageSize();
+        firstPage -= shift;
+        startOffset += shift;
     }
 
     Elf_Off curOff = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
@@ -907,8 +1280,9 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable() {
         }
 
     /* Clear out the free space. */
-    debug("clearing first %d bytes\n", startOffset - curOff);
+    debug("clearing first %llu bytes\n", (unsigned long long) (startOffset - curOff));
     memset(fileContents->data() + curOff, 0, startOffset - curOff);
+    fileStats.bytesZeroed += startOffset - curOff;
 
     /* Write out the replaced sections. */
     writeReplacedSections(curOff, firstPage, 0);
@@ -929,6 +1303,13 @@ void ElfFile<ElfFileParamNames>::normalizeNoteSegments() {
         [this](std::pair<const std::string, std::string> & i) { return rdi(findSectionHeader(i.first).sh_type) == SHT_NOTE; });
     if (!replaced_note) return;
 
+    OffsetIndex sectionsByOffset, notesByOffset;
+    for (unsigned int i = 0; i < shdrs.size(); ++i) {
+        sectionsByOffset.add(rdi(shdrs[i].sh_offset), i);
+        if (rdi(shdrs[i].sh_type) == SHT_NOTE)
+            notesByOffset.add(rdi(shdrs[i].sh_offset), i);
+    }
+
     std::vector<Elf_Phdr> newPhdrs;
     for (auto & phdr : phdrs) {
         if (rdi(phdr.p_type) != PT_NOTE) continue;
@@ -939,22 +1320,29 @@ void ElfFile<ElfFileParamNames>::normalizeNoteSegments() {
 
         /* Binaries produced by older patchelf versions may contain empty PT_NOTE segments.
            For backwards compatibility, if we find one we should ignore it. */
-        bool empty = std::none_of(shdrs.begin(), shdrs.end(),
-            [&](auto & shdr) { return rdi(shdr.sh_offset) >= start_off && rdi(shdr.sh_offset) < end_off; });
-        if (empty)
+        auto [first, last] = sectionsByOffset.range(start_off, end_off);
+        if (first == last)
             continue;
 
         while (curr_off < end_off) {
             /* Find a section that starts at the current offset. If we can't
                find one, it means the SHT_NOTE sections weren't contiguous
-               within the segment. */
+               within the segment.  Rounding up for alignment never goes
+               below the current offset, so the search starts there and
+               takes the first note whose aligned start is its offset; notes
+               at the same offset are ordered by header index, so the first
+               in the section header table wins. */
+            const Elf_Shdr * match = nullptr;
+            auto [note, notesEnd] = notesByOffset.range(curr_off, end_off);
+            for (; note != notesEnd && !match; ++note) {
+                const auto & shdr = shdrs[note->second];
+                if (note->first == roundUp(curr_off, rdi(shdr.sh_addralign)))
+                    match = &shdr;
+            }
             size_t size = 0;
-            for (const auto & shdr : shdrs) {
-                if (rdi(shdr.sh_type) != SHT_NOTE) continue;
-                if (rdi(shdr.sh_offset) != roundUp(curr_off, rdi(shdr.sh_addralign))) continue;
-                size = rdi(shdr.sh_size);
-                curr_off = roundUp(curr_off, rdi(shdr.sh_addralign));
-                break;
+            if (match) {
+                size = rdi(match->sh_size);
+                curr_off = roundUp(curr_off, rdi(match->sh_addralign));
             }
             if (size == 0)
                 error("cannot normalize PT_NOTE segment: non-contiguous SHT_NOTE sections");
@@ -980,6 +1368,7 @@ void ElfFile<ElfFileParamNames>::normalizeNoteSegments() {
         }
     }
     phdrs.insert(phdrs.end(), newPhdrs.begin(), newPhdrs.end());
+    accountMemory();
 
     wri(hdr()->e_phnum, phdrs.size());
 }
@@ -988,8 +1377,11 @@ template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::rewriteSections(bool force) {
     if (!force && replacedSections.empty()) return;
 
+    PhaseTimer timer(Phase::Rewrite);
+    TraceSpan span("rewriteSections");
+
     for (auto & i : replacedSections)
-        debug("replacing section '%s' with size %d\n",
+        debug("replacing section '%s' with size %zu\n",
             i.first.c_str(), i.second.size());
 
     if (rdi(hdr()->e_type) == ET_DYN) {
@@ -1001,8 +1393,45 @@ void ElfFile<ElfFileParamNames>::rewriteSections(bool force) {
     } else error("unknown ELF type");
 }
 
+/* Dynamic entries that hold the address (or size) of a section, with the
+   candidate sections in order of preference. */
+struct DynamicSectionRef {
+    unsigned int tag;
+    const char * sections[3];
+    bool size;     /* the entry holds the section size instead of its address */
+    bool required; /* fail if none of the sections exists, otherwise skip */
+};
+
+static const DynamicSectionRef dynamicSectionRefs[] = {
+    { DT_STRTAB, { ".dynstr" }, false, true },
+    { DT_STRSZ, { ".dynstr" }, true, true },
+    { DT_SYMTAB, { ".dynsym" }, false, true },
+    { DT_HASH, { ".hash" }, false, true },
+    /* some binaries might have .gnu.hash stripped, in which case we just
+       ignore the value. */
+    { DT_GNU_HASH, { ".gnu.hash" }, false, false },
+    /* the .MIPS.xhash section was added to the glibc-ABI in commit
+       23c1c256ae7b0f010d0fcaff60682b620887b164 */
+    { DT_MIPS_XHASH, { ".MIPS.xhash" }, false, true },
+    /* 32-bit, 64-bit Linux (x86-64), 64-bit Linux (IA-64) */
+    { DT_JMPREL, { ".rel.plt", ".rela.plt", ".rela.IA_64.pltoff" }, false, true },
+    /* !!! hack! .rel.got was needed for some program; some programs have
+       neither section, but this doesn't seem to be a problem */
+    { DT_REL, { ".rel.dyn", ".rel.got" }, false, false },
+    /* some programs lack this section, but it doesn't seem to be a
+       problem */
+    { DT_RELA, { ".rela.dyn" }, false, false },
+    { DT_VERNEED, { ".gnu.version_r" }, false, true },
+    { DT_VERSYM, { ".gnu.version" }, false, true },
+    { DT_MIPS_RLD_MAP_REL, { ".rld_map" }, false, false },
+};
+
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
+    /* The symbol table rewrite at the end is timed separately. */
+    std::optional<PhaseTimer> headersTimer(std::in_place, Phase::Headers);
+    TraceSpan span("rewriteHeaders");
+
     /* Rewrite the program header table. */
 
     /* If there is a segment for the program header table, update it.
@@ -1024,13 +1453,12 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
         * ((Elf_Phdr *) (fileContents->data() + rdi(hdr()->e_phoff)) + i) = phdrs.at(i);
 
 
-    /* Rewrite the section header table.  For neatness, keep the
-       sections sorted. */
-    assert(rdi(hdr()->e_shnum) == shdrs.size());
+    /* Rewrite the section header table (including section 0, see
+       above).  For neatness, keep the sections sorted. */
     if (!noSort) {
         sortShdrs();
     }
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
+    for (size_t i = 0; i < shdrs.size(); ++i)
         * ((Elf_Shdr *) (fileContents->data() + rdi(hdr()->e_shoff)) + i) = shdrs.at(i);
 
 
@@ -1039,59 +1467,34 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
        (e.g., those produced by klibc's klcc). */
     auto shdrDynamic = tryFindSectionHeader(".dynamic");
     if (shdrDynamic) {
+        /* Resolve all sections the dynamic entries may refer to in one
+           pass over the section headers, rather than a lookup by name per
+           entry. */
+        int found[std::size(dynamicSectionRefs)][std::size(dynamicSectionRefs[0].sections)];
+        std::fill(&found[0][0], &found[0][0] + sizeof(found) / sizeof(int), 0);
+        for (unsigned int i = 1; i < shdrs.size(); ++i) {
+            auto name = getSectionNameView(shdrs[i]);
+            for (unsigned int r = 0; r < std::size(dynamicSectionRefs); ++r)
+                for (unsigned int c = 0; c < std::size(dynamicSectionRefs[r].sections); ++c)
+                    if (!found[r][c] && dynamicSectionRefs[r].sections[c] && name == dynamicSectionRefs[r].sections[c])
+                        found[r][c] = i;
+        }
+
         auto dyn_table = (Elf_Dyn *) (fileContents->data() + rdi((*shdrDynamic).get().sh_offset));
         unsigned int d_tag;
-        for (auto dyn = dyn_table; (d_tag = rdi(dyn->d_tag)) != DT_NULL; dyn++)
-            if (d_tag == DT_STRTAB)
-                dyn->d_un.d_ptr = findSectionHeader(".dynstr").sh_addr;
-            else if (d_tag == DT_STRSZ)
-                dyn->d_un.d_val = findSectionHeader(".dynstr").sh_size;
-            else if (d_tag == DT_SYMTAB)
-                dyn->d_un.d_ptr = findSectionHeader(".dynsym").sh_addr;
-            else if (d_tag == DT_HASH)
-                dyn->d_un.d_ptr = findSectionHeader(".hash").sh_addr;
-            else if (d_tag == DT_GNU_HASH) {
-                auto shdr = tryFindSectionHeader(".gnu.hash");
-                // some binaries might this section stripped
-                // in which case we just ignore the value.
-                if (shdr) dyn->d_un.d_ptr = (*shdr).get().sh_addr;
-            } else if (d_tag == DT_MIPS_XHASH) {
-                // the .MIPS.xhash section was added to the glibc-ABI
-                // in commit 23c1c256ae7b0f010d0fcaff60682b620887b164
-                dyn->d_un.d_ptr = findSectionHeader(".MIPS.xhash").sh_addr;
-            } else if (d_tag == DT_JMPREL) {
-                auto shdr = tryFindSectionHeader(".rel.plt");
-                if (!shdr) shdr = tryFindSectionHeader(".rela.plt");
-                /* 64-bit Linux, x86-64 */
-                if (!shdr) shdr = tryFindSectionHeader(".rela.IA_64.pltoff"); /* 64-bit Linux, IA-64 */
-                if (!shdr) error("cannot find section corresponding to DT_JMPREL");
-                dyn->d_un.d_ptr = (*shdr).get().sh_addr;
-            }
-            else if (d_tag == DT_REL) { /* !!! hack! */
-                auto shdr = tryFindSectionHeader(".rel.dyn");
-                /* no idea if this makes sense, but it was needed for some
-                   program */
-                if (!shdr) shdr = tryFindSectionHeader(".rel.got");
-                /* some programs have neither section, but this doesn't seem
-                   to be a problem */
-                if (!shdr) continue;
-                dyn->d_un.d_ptr = (*shdr).get().sh_addr;
-            }
-            else if (d_tag == DT_RELA) {
-                auto shdr = tryFindSectionHeader(".rela.dyn");
-                /* some programs lack this section, but it doesn't seem to
-                   be a problem */
-                if (!shdr) continue;
-                dyn->d_un.d_ptr = (*shdr).get().sh_addr;
-            }
-            else if (d_tag == DT_VERNEED)
-                dyn->d_un.d_ptr = findSectionHeader(".gnu.version_r").sh_addr;
-            else if (d_tag == DT_VERSYM)
-                dyn->d_un.d_ptr = findSectionHeader(".gnu.version").sh_addr;
-            else if (d_tag == DT_MIPS_RLD_MAP_REL) {
+        for (auto dyn = dyn_table; (d_tag = rdi(dyn->d_tag)) != DT_NULL; dyn++) {
+            unsigned int r = 0;
+            while (r < std::size(dynamicSectionRefs) && dynamicSectionRefs[r].tag != d_tag) r++;
+            if (r == std::size(dynamicSectionRefs)) continue;
+            auto & ref = dynamicSectionRefs[r];
+
+            const Elf_Shdr * shdr = nullptr;
+            for (unsigned int c = 0; !shdr && c < std::size(ref.sections); ++c)
+                if (found[r][c]) shdr = &shdrs[found[r][c]];
+
+            if (d_tag == DT_MIPS_RLD_MAP_REL) {
                 /* the MIPS_RLD_MAP_REL tag stores the offset to the debug
                    pointer, relative to the address of the tag */
-                auto shdr = tryFindSectionHeader(".rld_map");
                 if (shdr) {
                     /*
                      * "When correct, (DT_MIPS_RLD_MAP_REL + tag offset + executable base address) equals DT_MIPS_RLD_MAP"
@@ -1103,7 +1506,7 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
                      *   DT_MIPS_RLD_MAP_REL              + executable base address == DT_MIPS_RLD_MAP - tag_offset
                      *   DT_MIPS_RLD_MAP_REL                                        == DT_MIPS_RLD_MAP - tag_offset - executable base address
                      */
-                    auto rld_map_addr = findSectionHeader(".rld_map").sh_addr;
+                    auto rld_map_addr = shdr->sh_addr;
                     auto dyn_offset = ((char*)dyn) - ((char*)dyn_table);
                     dyn->d_un.d_ptr = rld_map_addr - dyn_offset - (*shdrDynamic).get().sh_addr;
                 } else {
@@ -1111,33 +1514,82 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
                        is broken, and it's not our job to fix it; yet, we have
                        to find some location for dynamic loader to write the
                        debug pointer to; well, let's write it right here */
-                    fprintf(stderr, "warning: DT_MIPS_RLD_MAP_REL entry is present, but .rld_map section is not\n");
+                    warn("DT_MIPS_RLD_MAP_REL entry is present, but .rld_map section is not\n");
                     dyn->d_un.d_ptr = 0;
                 }
+                continue;
             }
+
+            if (!shdr) {
+                if (!ref.required) continue;
+                if (d_tag == DT_JMPREL) error("cannot find section corresponding to DT_JMPREL");
+                error(std::string("cannot find section '") + ref.sections[0] + "'");
+            }
+
+            if (ref.size)
+                dyn->d_un.d_val = shdr->sh_size;
+            else
+                dyn->d_un.d_ptr = shdr->sh_addr;
+        }
     }
 
 
     /* Rewrite the .dynsym section.  It contains the indices of the
        sections in which symbols appear, so these need to be
        remapped. */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
+    headersTimer.reset();
+    PhaseTimer timer(Phase::Symbols);
+
+    /* Symbols in sections numbered SHN_LORESERVE or above have
+       st_shndx == SHN_XINDEX; the real index is in the parallel
+       SHT_SYMTAB_SHNDX section whose sh_link names the symbol table.
+       Find those once rather than per symbol table. */
+    std::vector<std::pair<size_t, size_t>> xindexSections;
+    for (size_t i = 1; i < shdrs.size(); ++i)
+        if (rdi(shdrs[i].sh_type) == SHT_SYMTAB_SHNDX)
+            xindexSections.emplace_back(rdi(shdrs[i].sh_link), i);
+
+    for (size_t i = 1; i < shdrs.size(); ++i) {
         auto &shdr = shdrs.at(i);
         if (rdi(shdr.sh_type) != SHT_SYMTAB && rdi(shdr.sh_type) != SHT_DYNSYM) continue;
-        debug("rewriting symbol table section %d\n", i);
+        debug("rewriting symbol table section %zu\n", i);
+
+        Elf32_Word * xindex = nullptr;
+        size_t xindexCount = 0;
+        for (auto & [symtab, shndxSection] : xindexSections) {
+            if (symtab != i) continue;
+            auto & xshdr = shdrs.at(shndxSection);
+            xindex = (Elf32_Word *) (fileContents->data() + rdi(xshdr.sh_offset));
+            xindexCount = rdi(xshdr.sh_size) / sizeof(Elf32_Word);
+            checkPointer(fileContents, xindex, xindexCount * sizeof(Elf32_Word));
+            break;
+        }
+
         for (size_t entry = 0; (entry + 1) * sizeof(Elf_Sym) <= rdi(shdr.sh_size); entry++) {
             auto sym = (Elf_Sym *)(fileContents->data() + rdi(shdr.sh_offset) + entry * sizeof(Elf_Sym));
-            unsigned int shndx = rdi(sym->st_shndx);
-            if (shndx != SHN_UNDEF && shndx < SHN_LORESERVE) {
+            size_t shndx = rdi(sym->st_shndx);
+            bool extended = shndx == SHN_XINDEX && entry < xindexCount;
+            if (extended)
+                shndx = rdi(xindex[entry]);
+            else if (shndx >= SHN_LORESERVE)
+                continue;
+            if (shndx != SHN_UNDEF) {
                 if (shndx >= sectionsByOldIndex.size()) {
-                    fprintf(stderr, "warning: entry %d in symbol table refers to a non-existent section, skipping\n", shndx);
+                    warn("entry %zu in symbol table refers to a non-existent section, skipping\n", entry);
                     continue;
                 }
-                const std::string & section = sectionsByOldIndex.at(shndx);
-                assert(!section.empty());
-                auto newIndex = getSectionIndex(section); // inefficient
-                //debug("rewriting symbol %d: index = %d (%s) -> %d\n", entry, shndx, section.c_str(), newIndex);
-                wri(sym->st_shndx, newIndex);
+                assert(!sectionsByOldIndex.at(shndx).empty());
+                auto newIndex = sectionIndexes.at(shndx);
+                //debug("rewriting symbol %d: index = %d (%s) -> %d\n", entry, shndx, sectionsByOldIndex.at(shndx).c_str(), newIndex);
+                if (newIndex >= SHN_LORESERVE) {
+                    if (entry >= xindexCount)
+                        error("symbol needs an extended section index, but there is no matching SHT_SYMTAB_SHNDX section");
+                    wri(sym->st_shndx, SHN_XINDEX);
+                    wri(xindex[entry], newIndex);
+                } else {
+                    wri(sym->st_shndx, newIndex);
+                    if (extended) wri(xindex[entry], 0);
+                }
                 /* Rewrite st_value.  FIXME: we should do this for all
                    types, but most don't actually change. */
                 if (ELF32_ST_TYPE(rdi(sym->st_info)) == STT_SECTION)
@@ -1147,166 +1599,2135 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress) {
     }
 }
 
-static void setSubstr(std::string & s, unsigned int pos, const std::string & t) {
+static void setSubstr(std::string & s, size_t pos, const std::string & t) {
     assert(pos + t.size() <= s.size());
     copy(t.begin(), t.end(), s.begin() + pos);
 }
 
 template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::string> & libs) {
-    if (libs.empty()) return;
-
-    auto shdrDynamic = findSectionHeader(".dynamic");
-    auto shdrDynStr = findSectionHeader(".dynstr");
-    char * strTab = (char *) fileContents->data() + rdi(shdrDynStr.sh_offset);
-
-    auto dyn = (Elf_Dyn *)(fileContents->data() + rdi(shdrDynamic.sh_offset));
+Elf_Off ElfFile<ElfFileParamNames>::vaddrToOffset(Elf_Addr addr, size_t size) const {
+    for (auto & phdr : phdrs) {
+        if (rdi(phdr.p_type) != PT_LOAD) continue;
+        Elf_Addr start = rdi(phdr.p_vaddr);
+        if (addr >= start && addr - start <= rdi(phdr.p_filesz)
+            && size <= rdi(phdr.p_filesz) - (addr - start))
+            return rdi(phdr.p_offset) + (addr - start);
+    }
+    error("address is not mapped by any PT_LOAD segment");
+    return 0;
+}
 
-    unsigned int verNeedNum = 0;
+template<ElfFileParams>
+auto ElfFile<ElfFileParamNames>::findDynamicTable() const -> DynamicTable {
+    DynamicTable table;
+
+    auto dynamicPhdr = std::find_if(phdrs.begin(), phdrs.end(),
+        [this](const Elf_Phdr & phdr) { return rdi(phdr.p_type) == PT_DYNAMIC; });
+    if (dynamicPhdr == phdrs.end())
+        return table;
+
+    table.dyn = (Elf_Dyn *) (fileContents->data() + rdi(dynamicPhdr->p_offset));
+    table.count = rdi(dynamicPhdr->p_filesz) / sizeof(Elf_Dyn);
+    checkPointer(fileContents, table.dyn, table.count * sizeof(Elf_Dyn));
+
+    Elf_Addr strTabAddr = 0, verNeedAddr = 0;
+    Elf_Addr symTabAddr = 0, hashAddr = 0, gnuHashAddr = 0, verSymAddr = 0, verDefAddr = 0;
+    for (auto dyn = table.dyn; dyn != table.dyn + table.count && rdi(dyn->d_tag) != DT_NULL; ++dyn) {
+        switch (rdi(dyn->d_tag)) {
+            case DT_STRTAB: strTabAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_STRSZ: table.strTabSize = rdi(dyn->d_un.d_val); break;
+            case DT_VERNEED: verNeedAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_VERNEEDNUM: table.verNeedNum = rdi(dyn->d_un.d_val); break;
+            case DT_SYMTAB: symTabAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_HASH: hashAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_GNU_HASH: gnuHashAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_VERSYM: verSymAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_VERDEF: verDefAddr = rdi(dyn->d_un.d_ptr); break;
+            case DT_VERDEFNUM: table.verDefNum = rdi(dyn->d_un.d_val); break;
+        }
+    }
+    if (strTabAddr == 0 || table.strTabSize == 0)
+        error("cannot find DT_STRTAB/DT_STRSZ in the dynamic segment");
+
+    table.strTab = (char *) fileContents->data() + vaddrToOffset(strTabAddr, table.strTabSize);
+    if (verNeedAddr != 0 && table.verNeedNum != 0)
+        table.verNeed = vaddrToOffset(verNeedAddr, sizeof(Elf_Verneed));
+    else
+        table.verNeedNum = 0;
+
+    if (symTabAddr) table.symTab = vaddrToOffset(symTabAddr, sizeof(Elf_Sym));
+    if (hashAddr) table.hash = vaddrToOffset(hashAddr, 2 * sizeof(uint32_t));
+    if (gnuHashAddr) table.gnuHash = vaddrToOffset(gnuHashAddr, 4 * sizeof(uint32_t));
+    if (verSymAddr) table.verSym = vaddrToOffset(verSymAddr, sizeof(Elf_Versym));
+    if (verDefAddr && table.verDefNum) table.verDef = vaddrToOffset(verDefAddr, sizeof(Elf_Verdef));
+    else table.verDefNum = 0;
+
+    return table;
+}
 
-    unsigned int dynStrAddedBytes = 0;
-    std::unordered_map<std::string, Elf_Off> addedStrings;
+template<ElfFileParams>
+const uint32_t * ElfFile<ElfFileParamNames>::getWords(Elf_Off offset, size_t count) const {
+    auto p = (const uint32_t *) (fileContents->data() + offset);
+    checkPointer(fileContents, p, count * sizeof(uint32_t));
+    return p;
+}
 
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_NEEDED) {
-            char * name = strTab + rdi(dyn->d_un.d_val);
-            auto i = libs.find(name);
-            if (i != libs.end() && name != i->second) {
-                auto replacement = i->second;
+template<ElfFileParams>
+size_t ElfFile<ElfFileParamNames>::getDynamicSymbolCount(const DynamicTable & table) const {
+    auto words = [&](Elf_Off offset, size_t count) { return getWords(offset, count); };
+
+    /* DT_HASH: nchain equals the number of symbols. */
+    if (table.hash)
+        return rdi(words(table.hash, 2)[1]);
+
+    if (!table.gnuHash)
+        return 0;
+
+    /* DT_GNU_HASH only covers the symbols from symoffset on; the last one
+       ends the chain of the highest bucket. */
+    auto header = words(table.gnuHash, 4);
+    size_t nBuckets = rdi(header[0]), symOffset = rdi(header[1]), bloomSize = rdi(header[2]);
+    Elf_Off buckets = table.gnuHash + 4 * sizeof(uint32_t) + bloomSize * sizeof(Elf_Addr);
+    auto bucket = words(buckets, nBuckets);
+
+    size_t last = 0;
+    for (size_t i = 0; i < nBuckets; ++i)
+        last = std::max<size_t>(last, rdi(bucket[i]));
+    if (last < symOffset)
+        return symOffset;
+
+    Elf_Off chains = buckets + nBuckets * sizeof(uint32_t);
+    while (!(rdi(words(chains + (last - symOffset) * sizeof(uint32_t), 1)[0]) & 1))
+        last++;
+    return last + 1;
+}
 
-                debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, replacement.c_str());
+template<ElfFileParams>
+std::string_view ElfFile<ElfFileParamNames>::getDynamicString(const DynamicTable & table, size_t offset) const {
+    if (offset >= table.strTabSize)
+        error("dynamic string offset out of bounds");
+    size_t length = strnlen(table.strTab + offset, table.strTabSize - offset);
+    if (length == table.strTabSize - offset)
+        error("dynamic string table is not zero terminated");
+    return std::string_view(table.strTab + offset, length);
+}
 
-                auto a = addedStrings.find(replacement);
-                // the same replacement string has already been added, reuse it
-                if (a != addedStrings.end()) {
-                    wri(dyn->d_un.d_val, a->second);
-                    continue;
-                }
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::replaceNeededInPlace(const std::map<std::string, std::string> & libs) {
+    PhaseTimer timer(Phase::Plan);
+    TraceSpan span("plan");
+
+    auto table = findDynamicTable();
+    if (!table.dyn)
+        error("no section headers and no dynamic segment. The input file is probably a statically linked, self-decompressing binary");
+
+    /* Without section headers there is no way to tell what else lives
+       after the string table, so it cannot grow: a name is either pointed
+       at an existing copy of its replacement, or overwritten where it is,
+       which requires the replacement to fit.  Linkers merge string tails,
+       so a name is only overwritten if no other reference shares its
+       bytes; every reference into the table is collected for that, with
+       whether it names a library (DT_NEEDED or .gnu.version_r), as those
+       are the ones being replaced. */
+    struct StringRef {
+        size_t offset;
+        size_t length;
+        bool library;
+    };
+    std::vector<StringRef> refs;
+    auto addRef = [&](size_t offset, bool library) {
+        refs.push_back({ offset, getDynamicString(table, offset).size(), library });
+    };
+
+    for (auto dyn = table.dyn; dyn != table.dyn + table.count && rdi(dyn->d_tag) != DT_NULL; ++dyn) {
+        switch (rdi(dyn->d_tag)) {
+            case DT_NEEDED: addRef(rdi(dyn->d_un.d_val), true); break;
+            case DT_SONAME: case DT_RPATH: case DT_RUNPATH: case DT_AUXILIARY:
+            case DT_FILTER: case DT_CONFIG: case DT_DEPAUDIT: case DT_AUDIT:
+                addRef(rdi(dyn->d_un.d_val), false); break;
+        }
+    }
 
-                // technically, the string referred by d_val could be used otherwise, too (although unlikely)
-                // we'll therefore add a new string
-                debug("resizing .dynstr ...\n");
+    Elf_Off offset = table.verNeed;
+    for (size_t n = table.verNeedNum; n > 0; --n) {
+        auto need = (const Elf_Verneed *) (fileContents->data() + offset);
+        checkPointer(fileContents, need, sizeof(*need));
+        addRef(rdi(need->vn_file), true);
+        Elf_Off auxOffset = offset + rdi(need->vn_aux);
+        for (size_t m = rdi(need->vn_cnt); m > 0; --m) {
+            auto aux = (const Elf_Vernaux *) (fileContents->data() + auxOffset);
+            checkPointer(fileContents, aux, sizeof(*aux));
+            addRef(rdi(aux->vna_name), false);
+            if (rdi(aux->vna_next) == 0) break;
+            auxOffset += rdi(aux->vna_next);
+        }
+        if (rdi(need->vn_next) == 0) break;
+        offset += rdi(need->vn_next);
+    }
 
-                // relative location of the new string
-                Elf_Off strOffset = rdi(shdrDynStr.sh_size) + dynStrAddedBytes;
-                std::string & newDynStr = replaceSection(".dynstr",
-                    strOffset + replacement.size() + 1);
-                setSubstr(newDynStr, strOffset, replacement + '\0');
+    offset = table.verDef;
+    for (size_t n = table.verDefNum; n > 0; --n) {
+        auto def = (const Elf_Verdef *) (fileContents->data() + offset);
+        checkPointer(fileContents, def, sizeof(*def));
+        Elf_Off auxOffset = offset + rdi(def->vd_aux);
+        for (size_t m = rdi(def->vd_cnt); m > 0; --m) {
+            auto aux = (const Elf_Verdaux *) (fileContents->data() + auxOffset);
+            checkPointer(fileContents, aux, sizeof(*aux));
+            addRef(rdi(aux->vda_name), false);
+            if (rdi(aux->vda_next) == 0) break;
+            auxOffset += rdi(aux->vda_next);
+        }
+        if (rdi(def->vd_next) == 0) break;
+        offset += rdi(def->vd_next);
+    }
 
-                wri(dyn->d_un.d_val, strOffset);
-                addedStrings[replacement] = strOffset;
+    if (table.symTab) {
+        size_t count = getDynamicSymbolCount(table);
+        auto syms = (const Elf_Sym *) (fileContents->data() + table.symTab);
+        checkPointer(fileContents, syms, count * sizeof(Elf_Sym));
+        for (size_t i = 1; i < count; ++i)
+            if (rdi(syms[i].st_name) != 0)
+                addRef(rdi(syms[i].st_name), false);
+    }
 
-                dynStrAddedBytes += replacement.size() + 1;
+    /* Whether [offset, offset + length) can be overwritten: every string
+       touching those bytes must be this very library name. */
+    auto exclusive = [&](size_t offset, size_t length) {
+        return std::all_of(refs.begin(), refs.end(), [&](const StringRef & ref) {
+            bool overlaps = ref.offset < offset + length && offset <= ref.offset + ref.length;
+            return !overlaps || (ref.offset == offset && ref.library);
+        });
+    };
+
+    /* The names to replace, by their offset in the string table, with
+       the fields referring to them. */
+    struct Replacement {
+        std::string_view name;
+        const std::string * with;
+        const char * what = nullptr;
+        std::vector<std::function<void(size_t)>> repoint;
+        size_t copy = std::string_view::npos; /* of 'with' to point at */
+        bool overwrite = false;
+    };
+    std::map<size_t, Replacement> replacements;
+
+    auto collect = [&](auto & field, const char * what) {
+        size_t offset = rdi(field);
+        auto name = getDynamicString(table, offset);
+        auto i = libs.find(std::string(name));
+        if (i == libs.end() || name == i->second) {
+            debug("keeping %s entry '%s'\n", what, std::string(name).c_str());
+            return;
+        }
+        auto & r = replacements[offset];
+        r.name = name;
+        r.with = &i->second;
+        if (!r.what) r.what = what;
+        r.repoint.push_back([this, &field](size_t copy) { wri(field, copy); });
+    };
+
+    for (auto dyn = table.dyn; dyn != table.dyn + table.count && rdi(dyn->d_tag) != DT_NULL; ++dyn)
+        if (rdi(dyn->d_tag) == DT_NEEDED)
+            collect(dyn->d_un.d_val, "DT_NEEDED");
+
+    offset = table.verNeed;
+    for (size_t n = table.verNeedNum; n > 0; --n) {
+        auto need = (Elf_Verneed *) (fileContents->data() + offset);
+        checkPointer(fileContents, need, sizeof(*need));
+        collect(need->vn_file, ".gnu.version_r");
+        if (rdi(need->vn_next) == 0) break;
+        offset += rdi(need->vn_next);
+    }
 
-                changed = true;
-            } else {
-                debug("keeping DT_NEEDED entry '%s'\n", name);
+    /* An existing copy of a replacement, even as the tail of a longer
+       string, can be used as it is, but only if no name overwritten in
+       place touches it: with --replace-needed A B --replace-needed B C,
+       A must not end up pointing at B's bytes once they say C.  Every
+       overwrite can rule out a copy chosen before, so the choice is
+       repeated until it settles; all lookups see the original bytes. */
+    std::string_view strings(table.strTab, table.strTabSize);
+    std::vector<std::pair<size_t, size_t>> clobbered;
+    auto findCopy = [&](const std::string & s) {
+        std::string_view wanted(s.c_str(), s.size() + 1);
+        for (size_t pos = strings.find(wanted); pos != std::string_view::npos; pos = strings.find(wanted, pos + 1)) {
+            if (std::none_of(clobbered.begin(), clobbered.end(), [&](const std::pair<size_t, size_t> & range) {
+                    return pos < range.second && range.first < pos + wanted.size(); }))
+                return pos;
+        }
+        return std::string_view::npos;
+    };
+
+    for (bool settled = false; !settled; ) {
+        settled = true;
+        for (auto & [offset, r] : replacements) {
+            if (r.overwrite) continue;
+            r.copy = findCopy(*r.with);
+            if (r.copy == std::string_view::npos) {
+                r.overwrite = true;
+                clobbered.emplace_back(offset, offset + r.name.size() + 1);
+                settled = false;
             }
         }
-        if (rdi(dyn->d_tag) == DT_VERNEEDNUM) {
-            verNeedNum = rdi(dyn->d_un.d_val);
+    }
+
+    for (auto & [offset, r] : replacements) {
+        if (!r.overwrite) continue;
+        if (r.with->size() > r.name.size())
+            error("cannot replace '" + std::string(r.name) + "' with the longer '" + *r.with
+                + "' in a file without section headers");
+        if (!exclusive(offset, r.name.size()))
+            error("cannot replace '" + std::string(r.name) + "' in a file without section headers: "
+                "its bytes are shared with another string");
+    }
+
+    for (auto & [offset, r] : replacements) {
+        if (r.overwrite) {
+            debug("replacing %s entry '%s' with '%s' in place\n", r.what, std::string(r.name).c_str(), r.with->c_str());
+            char * dest = table.strTab + offset;
+            size_t length = r.name.size();
+            memcpy(dest, r.with->c_str(), r.with->size());
+            memset(dest + r.with->size(), 0, length - r.with->size());
+        } else {
+            debug("pointing %s entry '%s' to the existing string '%s'\n", r.what, std::string(r.name).c_str(), r.with->c_str());
+            for (auto & repoint : r.repoint)
+                repoint(r.copy);
         }
+        changed = true;
     }
+}
 
-    // If a replaced library uses symbol versions, then there will also be
-    // references to it in the "version needed" table, and these also need to
-    // be replaced.
+template<ElfFileParams>
+std::vector<std::string_view> ElfFile<ElfFileParamNames>::getVersionNames(const DynamicTable & table) const {
+    std::vector<std::string_view> versionNames;
+    Elf_Off offset = table.verDef;
+    for (size_t n = table.verDefNum; n > 0; --n) {
+        auto def = (const Elf_Verdef *) (fileContents->data() + offset);
+        checkPointer(fileContents, def, sizeof(*def));
+        auto aux = (const Elf_Verdaux *) (fileContents->data() + offset + rdi(def->vd_aux));
+        checkPointer(fileContents, aux, sizeof(*aux));
+        size_t ndx = rdi(def->vd_ndx) & versymVersion;
+        if (ndx >= versionNames.size()) versionNames.resize(ndx + 1);
+        versionNames[ndx] = getDynamicString(table, rdi(aux->vda_name));
+        if (rdi(def->vd_next) == 0) break;
+        offset += rdi(def->vd_next);
+    }
+    return versionNames;
+}
 
-    if (verNeedNum) {
-        auto shdrVersionR = findSectionHeader(".gnu.version_r");
-        // The filename strings in the .gnu.version_r are different from the
-        // ones in .dynamic: instead of being in .dynstr, they're in some
-        // arbitrary section and we have to look in ->sh_link to figure out
-        // which one.
-        Elf_Shdr & shdrVersionRStrings = shdrs.at(rdi(shdrVersionR.sh_link));
-        // this is where we find the actual filename strings
-        char * verStrTab = (char *) fileContents->data() + rdi(shdrVersionRStrings.sh_offset);
-        // and we also need the name of the section containing the strings, so
-        // that we can pass it to replaceSection
-        std::string versionRStringsSName = getSectionName(shdrVersionRStrings);
+template<ElfFileParams>
+bool ElfFile<ElfFileParamNames>::isExportedSymbol(const Elf_Sym & sym) const {
+    auto bind = ELF32_ST_BIND(rdi(sym.st_info));
+    auto visibility = ELF32_ST_VISIBILITY(rdi(sym.st_other));
+    return rdi(sym.st_shndx) != SHN_UNDEF
+        && (bind == STB_GLOBAL || bind == STB_WEAK || bind == STB_GNU_UNIQUE)
+        && (visibility == STV_DEFAULT || visibility == STV_PROTECTED);
+}
 
-        debug("found .gnu.version_r with %i entries, strings in %s\n", verNeedNum, versionRStringsSName.c_str());
+template<ElfFileParams>
+ElfDependencies ElfFile<ElfFileParamNames>::getDependencies(bool withSymbols) const {
+    ElfDependencies deps;
+    deps.elfClass = ElfClass;
+    deps.machine = rdi(hdr()->e_machine);
 
-        unsigned int verStrAddedBytes = 0;
-        // It may be that it is .dynstr again, in which case we must take the already
-        // added bytes into account.
-        if (versionRStringsSName == ".dynstr")
-            verStrAddedBytes += dynStrAddedBytes;
-        else
-            // otherwise the already added strings can't be reused
-            addedStrings.clear();
+    for (auto & phdr : phdrs) {
+        if (rdi(phdr.p_type) != PT_INTERP) continue;
+        auto interp = (const char *) fileContents->data() + rdi(phdr.p_offset);
+        checkPointer(fileContents, interp, rdi(phdr.p_filesz));
+        deps.interpreter.emplace(interp, strnlen(interp, rdi(phdr.p_filesz)));
+    }
 
-        auto need = (Elf_Verneed *)(fileContents->data() + rdi(shdrVersionR.sh_offset));
-        while (verNeedNum > 0) {
-            char * file = verStrTab + rdi(need->vn_file);
-            auto i = libs.find(file);
-            if (i != libs.end() && file != i->second) {
-                auto replacement = i->second;
+    auto table = findDynamicTable();
+    for (auto dyn = table.dyn; dyn && dyn != table.dyn + table.count && rdi(dyn->d_tag) != DT_NULL; ++dyn) {
+        switch (rdi(dyn->d_tag)) {
+            case DT_NEEDED: deps.needed.emplace_back(getDynamicString(table, rdi(dyn->d_un.d_val))); break;
+            case DT_SONAME: deps.soname = getDynamicString(table, rdi(dyn->d_un.d_val)); break;
+            case DT_RPATH: deps.rpath = getDynamicString(table, rdi(dyn->d_un.d_val)); break;
+            case DT_RUNPATH: deps.runpath = getDynamicString(table, rdi(dyn->d_un.d_val)); break;
+        }
+    }
+
+    /* The version requirements: one Elf_Verneed per library, each with a
+       list of Elf_Vernaux naming the versions needed from it. */
+    Elf_Off offset = table.verNeed;
+    for (size_t n = table.verNeedNum; n > 0; --n) {
+        auto need = (const Elf_Verneed *) (fileContents->data() + offset);
+        checkPointer(fileContents, need, sizeof(*need));
+
+        auto & versionNeed = deps.verneed.emplace_back();
+        versionNeed.file = getDynamicString(table, rdi(need->vn_file));
+
+        Elf_Off auxOffset = offset + rdi(need->vn_aux);
+        for (size_t m = rdi(need->vn_cnt); m > 0; --m) {
+            auto aux = (const Elf_Vernaux *) (fileContents->data() + auxOffset);
+            checkPointer(fileContents, aux, sizeof(*aux));
+            versionNeed.versions.emplace_back(getDynamicString(table, rdi(aux->vna_name)));
+            if (rdi(aux->vna_next) == 0) break;
+            auxOffset += rdi(aux->vna_next);
+        }
 
-                debug("replacing .gnu.version_r entry '%s' with '%s'\n", file, replacement.c_str());
+        if (rdi(need->vn_next) == 0) break;
+        offset += rdi(need->vn_next);
+    }
 
-                auto a = addedStrings.find(replacement);
-                // the same replacement string has already been added, reuse it
-                if (a != addedStrings.end()) {
-                    wri(need->vn_file, a->second);
-                } else {
-                    debug("resizing string section %s ...\n", versionRStringsSName.c_str());
+    if (!withSymbols || !table.symTab)
+        return deps;
 
-                    Elf_Off strOffset = rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes;
-                    std::string & newVerDynStr = replaceSection(versionRStringsSName,
-                        strOffset + replacement.size() + 1);
-                    setSubstr(newVerDynStr, strOffset, replacement + '\0');
+    auto versionNames = getVersionNames(table);
 
-                    wri(need->vn_file, strOffset);
-                    addedStrings[replacement] = strOffset;
+    size_t count = getDynamicSymbolCount(table);
+    auto syms = (const Elf_Sym *) (fileContents->data() + table.symTab);
+    checkPointer(fileContents, syms, count * sizeof(Elf_Sym));
+    auto versyms = (const Elf_Versym *) (fileContents->data() + table.verSym);
+    if (table.verSym)
+        checkPointer(fileContents, versyms, count * sizeof(Elf_Versym));
 
-                    verStrAddedBytes += replacement.size() + 1;
-                }
+    for (size_t i = 1; i < count; ++i) {
+        auto & sym = syms[i];
+        if (!isExportedSymbol(sym))
+            continue;
 
-                changed = true;
-            } else {
-                debug("keeping .gnu.version_r entry '%s'\n", file);
-            }
-            // the Elf_Verneed structures form a linked list, so jump to next entry
-            need = (Elf_Verneed *) (((char *) need) + rdi(need->vn_next));
-            --verNeedNum;
+        auto & symbol = deps.symbols.emplace_back();
+        symbol.hash = gnuHash(getDynamicString(table, rdi(sym.st_name)));
+        symbol.hidden = false;
+        if (table.verSym) {
+            unsigned int versym = rdi(versyms[i]);
+            size_t ndx = versym & versymVersion;
+            symbol.hidden = versym & versymHidden;
+            if (ndx < versionNames.size())
+                symbol.version = versionNames[ndx];
         }
     }
 
-    this->rewriteSections();
+    return deps;
 }
 
-static std::map<std::string, std::string> neededLibsToReplace;
+template<ElfFileParams>
+std::vector<bool> ElfFile<ElfFileParamNames>::hasSymbols(const std::vector<SymbolQuery> & queries) const {
+    std::vector<bool> found(queries.size(), false);
+
+    auto table = findDynamicTable();
+    if (!table.symTab || (!table.gnuHash && !table.hash))
+        return found;
+
+    bool versioned = table.verSym && std::any_of(queries.begin(), queries.end(),
+        [](const SymbolQuery & query) { return query.version.has_value(); });
+    auto versionNames = versioned ? getVersionNames(table) : std::vector<std::string_view>();
+
+    /* Whether symbol i is the one queried.  Without a version, only the
+       default version of a symbol counts, as for an unversioned
+       reference in the loader. */
+    auto matches = [&](size_t i, const SymbolQuery & query) {
+        auto sym = (const Elf_Sym *) (fileContents->data() + table.symTab + i * sizeof(Elf_Sym));
+        checkPointer(fileContents, sym, sizeof(*sym));
+        if (!isExportedSymbol(*sym) || getDynamicString(table, rdi(sym->st_name)) != query.name)
+            return false;
+        if (!table.verSym)
+            return !query.version;
+
+        auto versym = (const Elf_Versym *) (fileContents->data() + table.verSym + i * sizeof(Elf_Versym));
+        checkPointer(fileContents, versym, sizeof(*versym));
+        bool hidden = rdi(*versym) & versymHidden;
+        if (!query.version)
+            return !hidden;
+        size_t ndx = rdi(*versym) & versymVersion;
+        return ndx < versionNames.size() && versionNames[ndx] == *query.version
+            && !(query.defaultVersion && hidden);
+    };
+
+    if (table.gnuHash) {
+        auto header = getWords(table.gnuHash, 4);
+        size_t nBuckets = rdi(header[0]), symOffset = rdi(header[1]);
+        size_t bloomSize = rdi(header[2]), bloomShift = rdi(header[3]);
+        if (nBuckets == 0 || bloomSize == 0)
+            return found;
+
+        auto bloom = (const Elf_Addr *) (fileContents->data() + table.gnuHash + 4 * sizeof(uint32_t));
+        checkPointer(fileContents, bloom, bloomSize * sizeof(Elf_Addr));
+        Elf_Off buckets = table.gnuHash + 4 * sizeof(uint32_t) + bloomSize * sizeof(Elf_Addr);
+        auto bucket = getWords(buckets, nBuckets);
+        Elf_Off chains = buckets + nBuckets * sizeof(uint32_t);
+
+        for (size_t q = 0; q < queries.size(); ++q) {
+            uint32_t h = queries[q].gnuHash;
+
+            /* The Bloom filter rejects most absent names from a single
+               word, without touching the buckets. */
+            Elf_Addr word = rdi(bloom[(h / ElfClass) % bloomSize]);
+            Elf_Addr mask = ((Elf_Addr) 1 << (h % ElfClass)) | ((Elf_Addr) 1 << ((h >> bloomShift) % ElfClass));
+            if ((word & mask) != mask)
+                continue;
 
-template<class ElfFile>
-static void patchElf2(
+            /* Chain entries hold the hashes with the low bit marking the
+               end of the chain, so names are only compared on a match. */
+            for (size_t i = rdi(bucket[h % nBuckets]); i >= symOffset && i != 0; ++i) {
+                uint32_t chain = rdi(getWords(chains + (i - symOffset) * sizeof(uint32_t), 1)[0]);
+                if ((chain | 1) == (h | 1) && matches(i, queries[q])) {
+                    found[q] = true;
+                    break;
+                }
+                if (chain & 1) break;
+            }
+        }
+        return found;
+    }
+
+    auto header = getWords(table.hash, 2);
+    size_t nBuckets = rdi(header[0]), nChains = rdi(header[1]);
+    if (nBuckets == 0)
+        return found;
+    auto bucket = getWords(table.hash + 2 * sizeof(uint32_t), nBuckets);
+    auto chain = getWords(table.hash + (2 + nBuckets) * sizeof(uint32_t), nChains);
+
+    for (size_t q = 0; q < queries.size(); ++q) {
+        size_t steps = 0;
+        for (size_t i = rdi(bucket[queries[q].sysvHash % nBuckets]);
+             i != STN_UNDEF && i < nChains && steps++ < nChains; i = rdi(chain[i]))
+            if (matches(i, queries[q])) {
+                found[q] = true;
+                break;
+            }
+    }
+    return found;
+}
+
+template<ElfFileParams>
+Elf_Off ElfFile<ElfFileParamNames>::addString(const SectionName & sectionName, const std::string & s) {
+    auto & added = addedStrings[sectionName];
+    auto a = added.find(s);
+    // the same string has already been added, reuse it
+    if (a != added.end())
+        return a->second;
+
+    // technically, an existing string could be in use elsewhere, too
+    // (although unlikely), so we always add a new one
+    debug("resizing %s ...\n", sectionName.c_str());
+
+    auto i = replacedSections.find(sectionName);
+    Elf_Off offset = i != replacedSections.end() ? i->second.size() : rdi(findSectionHeader(sectionName).sh_size);
+    std::string & newStrTab = replaceSection(sectionName, offset + s.size() + 1);
+    setSubstr(newStrTab, offset, s + '\0');
+
+    added.emplace(s, offset);
+    return offset;
+}
+
+template<ElfFileParams>
+const char * ElfFile<ElfFileParamNames>::getStagedString(const Elf_Shdr & shdr, size_t offset) const {
+    auto i = replacedSections.find(getSectionName(shdr));
+    if (i != replacedSections.end()) {
+        if (offset >= i->second.size())
+            error("string offset out of bounds");
+        return i->second.c_str() + offset;
+    }
+    if (offset >= rdi(shdr.sh_size))
+        error("string offset out of bounds");
+    return (const char *) fileContents->data() + rdi(shdr.sh_offset) + offset;
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::commit() {
+    addedStrings.clear();
+    rewriteSections();
+}
+
+template<ElfFileParams>
+ElfFile<ElfFileParamNames> ElfFile<ElfFileParamNames>::forkVariant() const {
+    assert(!changed && replacedSections.empty());
+    ElfFile variant(*this);
+    variant.fileContents = bufferPool.acquire(fileContents->size());
+    memcpy(variant.fileContents->data(), fileContents->data(), fileContents->size());
+    return variant;
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::string> & libs) {
+    if (libs.empty()) return;
+
+    if (shdrs.empty()) {
+        replaceNeededInPlace(libs);
+        return;
+    }
+
+    PhaseTimer timer(Phase::Plan);
+    TraceSpan span("plan");
+
+    auto shdrDynamic = findSectionHeader(".dynamic");
+    auto shdrDynStr = findSectionHeader(".dynstr");
+
+    auto dyn = (Elf_Dyn *)(fileContents->data() + rdi(shdrDynamic.sh_offset));
+
+    unsigned int verNeedNum = 0;
+
+    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
+        if (rdi(dyn->d_tag) == DT_NEEDED) {
+            const char * name = getStagedString(shdrDynStr, rdi(dyn->d_un.d_val));
+            auto i = libs.find(name);
+            if (i != libs.end() && name != i->second) {
+                debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, i->second.c_str());
+                wri(dyn->d_un.d_val, addString(".dynstr", i->second));
+                changed = true;
+            } else {
+                debug("keeping DT_NEEDED entry '%s'\n", name);
+            }
+        }
+        if (rdi(dyn->d_tag) == DT_VERNEEDNUM) {
+            verNeedNum = rdi(dyn->d_un.d_val);
+        }
+    }
+
+    // If a replaced library uses symbol versions, then there will also be
+    // references to it in the "version needed" table, and these also need to
+    // be replaced.
+
+    if (verNeedNum) {
+        auto shdrVersionR = findSectionHeader(".gnu.version_r");
+        // The filename strings in the .gnu.version_r are different from the
+        // ones in .dynamic: instead of being in .dynstr, they're in some
+        // arbitrary section and we have to look in ->sh_link to figure out
+        // which one.
+        Elf_Shdr & shdrVersionRStrings = shdrs.at(rdi(shdrVersionR.sh_link));
+        // and we also need the name of the section containing the strings, so
+        // that we can pass it to addString (if it is .dynstr again, the
+        // strings added above are reused)
+        std::string versionRStringsSName = getSectionName(shdrVersionRStrings);
+
+        debug("found .gnu.version_r with %i entries, strings in %s\n", verNeedNum, versionRStringsSName.c_str());
+
+        auto need = (Elf_Verneed *)(fileContents->data() + rdi(shdrVersionR.sh_offset));
+        while (verNeedNum > 0) {
+            const char * file = getStagedString(shdrVersionRStrings, rdi(need->vn_file));
+            auto i = libs.find(file);
+            if (i != libs.end() && file != i->second) {
+                debug("replacing .gnu.version_r entry '%s' with '%s'\n", file, i->second.c_str());
+                wri(need->vn_file, addString(versionRStringsSName, i->second));
+                changed = true;
+            } else {
+                debug("keeping .gnu.version_r entry '%s'\n", file);
+            }
+            // the Elf_Verneed structures form a linked list, so jump to next entry
+            need = (Elf_Verneed *) (((char *) need) + rdi(need->vn_next));
+            --verNeedNum;
+        }
+    }
+}
+
+static std::map<std::string, std::string> neededLibsToReplace;
+
+static bool queryMode = false;
+
+/* --variant: outputs patched from the same input, each with its own
+   --replace-needed rules on top of those given before the first
+   --variant. */
+struct Variant {
+    std::string outputFileName;
+    std::map<std::string, std::string> neededLibsToReplace;
+};
+static std::vector<Variant> variants;
+
+/* --has-symbol: the symbols to look up in every file. */
+static std::vector<SymbolQuery> symbolQueries;
+
+/* For --dep-graph: the root of the tree without a trailing slash, and
+   the ELF files in it (by their path inside it, e.g. "/usr/lib/libz.so.1")
+   with their dependencies, in the order of fileNames. */
+static bool depGraphMode = false;
+static std::string depGraphRoot;
+static std::vector<std::string> depGraphPaths;
+static std::vector<FileStamp> depGraphStamps;
+static std::vector<ElfDependencies> depGraphFiles;
+static std::unordered_map<std::string, size_t> depGraphIndex;
+
+/* --build-index: also collect the exported symbols. */
+static bool buildIndexMode = false;
+static std::string indexFileName;
+
+/* A --build-index file mapped into memory; nothing is read from it
+   until an entry is looked up. */
+class SysrootIndex {
+public:
+    SysrootIndex() = default;
+    SysrootIndex(const SysrootIndex &) = delete;
+    SysrootIndex & operator=(const SysrootIndex &) = delete;
+    ~SysrootIndex() {
+        if (map) munmap(map, mapSize);
+    }
+
+    /* Map the file; false if it doesn't exist or isn't a usable index. */
+    bool open(const std::string & fileName) {
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(IndexHeader)) {
+            mapSize = st.st_size;
+            map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) map = nullptr;
+        }
+        close(fd);
+        if (map && !validate()) {
+            warn("ignoring invalid index '%s'\n", fileName.c_str());
+            munmap(map, mapSize);
+            map = nullptr;
+        }
+        return map;
+    }
+
+    /* The entry of a file by its path inside the sysroot, if it is still
+       current. */
+    const IndexFile * find(const std::string & path, const FileStamp & stamp) const {
+        if (!map) return nullptr;
+        auto end = files + header->fileCount;
+        auto i = std::lower_bound(files, end, path, [&](const IndexFile & f, const std::string & p) {
+            return string(f.path) < p;
+        });
+        if (i == end || string(i->path) != path || !(i->stamp == stamp)) return nullptr;
+        return i;
+    }
+
+    [[nodiscard]] ElfDependencies load(const IndexFile & file, bool withSymbols) const {
+        ElfDependencies deps;
+        deps.elfClass = file.elfClass;
+        deps.machine = file.machine;
+        deps.soname = optionalString(file.soname);
+        deps.rpath = optionalString(file.rpath);
+        deps.runpath = optionalString(file.runpath);
+        for (uint32_t i = 0; i < file.neededCount; ++i)
+            deps.needed.emplace_back(string(needed[file.firstNeeded + i]));
+        for (uint32_t i = 0; withSymbols && i < file.symbolCount; ++i) {
+            auto & sym = symbols[file.firstSymbol + i];
+            deps.symbols.push_back({ sym.hash, std::string(string(sym.version & ~indexSymbolHidden)),
+                (sym.version & indexSymbolHidden) != 0 });
+        }
+        return deps;
+    }
+
+    /* Call f with the path of every indexed file whose DT_SONAME is
+       'soname'. */
+    template<class F>
+    void forEachWithSoname(std::string_view soname, F f) const {
+        if (!map) return;
+        uint32_t mask = header->sonameSlots - 1;
+        uint32_t slot = gnuHash(soname) & mask;
+        for (uint32_t probes = 0; probes < header->sonameSlots && sonames[slot]; ++probes) {
+            auto & file = files[sonames[slot] - 1];
+            if (file.soname != indexNoString && string(file.soname) == soname)
+                f(string(file.path));
+            slot = (slot + 1) & mask;
+        }
+    }
+
+private:
+    void * map = nullptr;
+    size_t mapSize = 0;
+    const IndexHeader * header = nullptr;
+    const IndexFile * files = nullptr;
+    const uint32_t * needed = nullptr;
+    const IndexSymbol * symbols = nullptr;
+    const uint32_t * sonames = nullptr;
+    const char * strings = nullptr;
+
+    std::string_view string(uint32_t offset) const {
+        return offset < header->stringsSize ? std::string_view(strings + offset) : std::string_view();
+    }
+
+    std::optional<std::string> optionalString(uint32_t offset) const {
+        if (offset == indexNoString) return {};
+        return std::string(string(offset));
+    }
+
+    bool validate() {
+        header = (const IndexHeader *) map;
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+            return offset % 8 == 0 && offset <= mapSize && count <= (mapSize - offset) / size;
+        };
+        if (memcmp(header->magic, indexMagic, sizeof(indexMagic)) != 0
+            || !fits(header->files, header->fileCount, sizeof(IndexFile))
+            || !fits(header->needed, header->neededCount, sizeof(uint32_t))
+            || !fits(header->symbols, header->symbolCount, sizeof(IndexSymbol))
+            || header->sonameSlots == 0 || (header->sonameSlots & (header->sonameSlots - 1)) != 0
+            || !fits(header->sonames, header->sonameSlots, sizeof(uint32_t))
+            || !fits(header->strings, header->stringsSize, 1)
+            || header->stringsSize == 0)
+            return false;
+        files = (const IndexFile *) ((const char *) map + header->files);
+        needed = (const uint32_t *) ((const char *) map + header->needed);
+        symbols = (const IndexSymbol *) ((const char *) map + header->symbols);
+        sonames = (const uint32_t *) ((const char *) map + header->sonames);
+        strings = (const char *) map + header->strings;
+        if (strings[header->stringsSize - 1] != 0)
+            return false;
+        for (uint32_t i = 0; i < header->fileCount; ++i)
+            if ((uint64_t) files[i].firstNeeded + files[i].neededCount > header->neededCount
+                || (uint64_t) files[i].firstSymbol + files[i].symbolCount > header->symbolCount)
+                return false;
+        for (uint32_t i = 0; i < header->sonameSlots; ++i)
+            if (sonames[i] > header->fileCount)
+                return false;
+        return true;
+    }
+};
+
+static SysrootIndex sysrootIndex;
+
+/* Returns the contents to write out, or nothing if the file is to be left
+   alone. */
+template<class ElfFile>
+[[nodiscard]] static FileContents patchElf2(
 	ElfFile && elfFile,
-	const FileContents & fileContents,
-	const std::string & fileName
+	const FileContents & fileContents
 ) {  
     elfFile.replaceNeeded(neededLibsToReplace);
+    elfFile.commit();
 
     if (elfFile.isChanged()){
-        writeFile(fileName, elfFile.fileContents);
+        return elfFile.fileContents;
     } else if (alwaysWrite) {
         debug("not modified, but alwaysWrite=true\n");
-        writeFile(fileName, fileContents);
+        return fileContents;
     }
+    return FileContents();
 }
 
+/* Write every --variant of a file from a single read and parse.  The
+   buffer can't be shared copy-on-write once a variant is rewritten, as
+   the rewrite works in place, so a variant gets a copy only if one of
+   its rules names a library the file actually needs; the others are
+   written straight from the input. */
+template<class Elf>
+static void patchVariants(Elf && parsed, const FileContents & fileContents) {
+    auto deps = parsed.getDependencies();
+    std::set<std::string> needed(deps.needed.begin(), deps.needed.end());
+    for (auto & need : deps.verneed)
+        needed.insert(need.file);
+
+    for (auto & variant : variants) {
+        TraceSpan span("variant");
+        span.arg("name", variant.outputFileName);
+
+        FileContents output = fileContents;
+        auto & libs = variant.neededLibsToReplace;
+        if (std::any_of(libs.begin(), libs.end(),
+                [&](auto & lib) { return lib.first != lib.second && needed.count(lib.first); })) {
+            auto elfFile = parsed.forkVariant();
+            elfFile.replaceNeeded(libs);
+            elfFile.commit();
+            if (elfFile.isChanged())
+                output = elfFile.fileContents;
+        } else
+            debug("variant '%s' leaves the file unchanged\n", variant.outputFileName.c_str());
+
+        writeFile(variant.outputFileName, output);
+    }
+}
 
-static void patchElf() {
-    for (const auto & fileName : fileNames) { 
-        debug("patching ELF file '%s'\n", fileName.c_str());
+[[nodiscard]] static ElfDependencies readDependencies(const FileContents & fileContents, bool withSymbols = false) {
+    if (getElfType(fileContents).is32Bit)
+        return ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents).getDependencies(withSymbols);
+    else
+        return ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents).getDependencies(withSymbols);
+}
 
-        auto fileContents = readFile(fileName);
-        const std::string & outputFileName2 = outputFileName.empty() ? fileName : outputFileName;
+static std::string jsonString(const std::optional<std::string> & s) {
+    return s ? "\"" + jsonEscape(*s) + "\"" : "null";
+}
+
+/* Print the dependency information of a file as one line of JSON; the
+   file is only read. */
+static void printDependencies(const std::string & fileName, const ElfDependencies & deps) {
+    std::string record = "{\"file\":" + jsonString(fileName) + ",\"class\":" + std::to_string(deps.elfClass);
+    record += ",\"interpreter\":" + jsonString(deps.interpreter) + ",\"soname\":" + jsonString(deps.soname);
+    record += ",\"rpath\":" + jsonString(deps.rpath) + ",\"runpath\":" + jsonString(deps.runpath);
+    record += ",\"needed\":[";
+    for (size_t i = 0; i < deps.needed.size(); ++i)
+        record += (i ? "," : "") + jsonString(deps.needed[i]);
+    record += "],\"verneed\":[";
+    for (size_t i = 0; i < deps.verneed.size(); ++i) {
+        record += (i ? ",{\"file\":" : "{\"file\":") + jsonString(deps.verneed[i].file) + ",\"versions\":[";
+        for (size_t j = 0; j < deps.verneed[i].versions.size(); ++j)
+            record += (j ? "," : "") + jsonString(deps.verneed[i].versions[j]);
+        record += "]}";
+    }
+    record += "]}\n";
+
+    /* A single fwrite() keeps the records of parallel jobs from interleaving. */
+    fwrite(record.data(), 1, record.size(), stdout);
+}
+
+/* Print which of the --has-symbol queries a file exports as one line of
+   JSON, keyed by the queries as given. */
+static void printSymbolPresence(const std::string & fileName, const FileContents & fileContents) {
+    std::vector<bool> found;
+    if (getElfType(fileContents).is32Bit)
+        found = ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents).hasSymbols(symbolQueries);
+    else
+        found = ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents).hasSymbols(symbolQueries);
+
+    std::string record = "{\"file\":" + jsonString(fileName) + ",\"symbols\":{";
+    for (size_t i = 0; i < symbolQueries.size(); ++i) {
+        auto & query = symbolQueries[i];
+        std::string key = query.name;
+        if (query.version)
+            key += (query.defaultVersion ? "@@" : "@") + *query.version;
+        record += (i ? "," : "") + jsonString(key) + (found[i] ? ":true" : ":false");
+    }
+    record += "}}\n";
+
+    fwrite(record.data(), 1, record.size(), stdout);
+}
+
+
+enum class StatsFormat { Text, Json };
+static StatsFormat statsFormat = StatsFormat::Text;
+
+static const char * phaseNames[] = { "read", "parse", "plan", "rewrite", "sort", "shift", "headers", "symbols", "write" };
+static_assert(std::size(phaseNames) == static_cast<unsigned>(Phase::Count));
+
+static const char * memCategoryNames[] = { "file", "sections", "headers", "names" };
+static_assert(std::size(memCategoryNames) == static_cast<unsigned>(MemCategory::Count));
+
+static void printStats(const std::string & name, const PatchStats & stats, size_t files = 0) {
+    if (statsFormat == StatsFormat::Json) {
+        fprintf(stderr, "{");
+        if (files)
+            fprintf(stderr, "\"files\":%zu", files);
+        else
+            fprintf(stderr, "\"file\":\"%s\"", jsonEscape(name).c_str());
+        fprintf(stderr, ",\"seconds\":{");
+        for (unsigned int i = 0; i < static_cast<unsigned>(Phase::Count); ++i)
+            fprintf(stderr, "%s\"%s\":%.6f", i ? "," : "", phaseNames[i], stats.seconds[i]);
+        fprintf(stderr, "},\"bytes\":{\"read\":%llu,\"written\":%llu,\"moved\":%llu,\"zeroed\":%llu}",
+            (unsigned long long) stats.bytesRead, (unsigned long long) stats.bytesWritten,
+            (unsigned long long) stats.bytesMoved, (unsigned long long) stats.bytesZeroed);
+        fprintf(stderr, ",\"events\":{\"relocatePht\":%u,\"newLoad\":%u,\"pageShift\":%u}",
+            stats.relocatedPhts, stats.newLoadSegments, stats.pageShifts);
+        fprintf(stderr, ",\"sections\":{\"count\":%llu,\"lookups\":%llu,\"scanned\":%llu}",
+            (unsigned long long) stats.sections, (unsigned long long) stats.sectionLookups,
+            (unsigned long long) stats.sectionsScanned);
+        fprintf(stderr, ",\"memory\":{\"peak\":%llu", (unsigned long long) stats.memoryPeakTotal);
+        for (unsigned int i = 0; i < static_cast<unsigned>(MemCategory::Count); ++i)
+            fprintf(stderr, ",\"%s\":%llu", memCategoryNames[i], (unsigned long long) stats.memoryPeak[i]);
+        fprintf(stderr, ",\"maxRssKiB\":%ld}}", stats.maxRssKiB);
+        return;
+    }
+
+    if (files)
+        fprintf(stderr, "stats: %s (%zu files):", name.c_str(), files);
+    else
+        fprintf(stderr, "stats: %s:", name.c_str());
+    for (unsigned int i = 0; i < static_cast<unsigned>(Phase::Count); ++i)
+        fprintf(stderr, "%s %s %.3f ms", i ? "," : "", phaseNames[i], stats.seconds[i] * 1e3);
+    fprintf(stderr, "; bytes read %llu, written %llu, moved %llu, zeroed %llu",
+        (unsigned long long) stats.bytesRead, (unsigned long long) stats.bytesWritten,
+        (unsigned long long) stats.bytesMoved, (unsigned long long) stats.bytesZeroed);
+    fprintf(stderr, "; %u PHT relocations, %u new PT_LOAD, %u page shifts",
+        stats.relocatedPhts, stats.newLoadSegments, stats.pageShifts);
+    fprintf(stderr, "; %llu sections, %llu lookups scanning %llu",
+        (unsigned long long) stats.sections, (unsigned long long) stats.sectionLookups,
+        (unsigned long long) stats.sectionsScanned);
+    fprintf(stderr, "; peak memory %llu (", (unsigned long long) stats.memoryPeakTotal);
+    for (unsigned int i = 0; i < static_cast<unsigned>(MemCategory::Count); ++i)
+        fprintf(stderr, "%s%s %llu", i ? ", " : "", memCategoryNames[i], (unsigned long long) stats.memoryPeak[i]);
+    fprintf(stderr, "), max RSS %ld KiB\n", stats.maxRssKiB);
+}
+
+static PatchStats totalStats;
+static size_t statsFilesReported = 0;
+static std::mutex statsMutex;
+
+/* The size and latency (from being started to being reported) of every
+   file, for the percentiles of the total. */
+static std::vector<std::pair<uint64_t, double>> statsLatencies;
+
+/* --stats-baseline: the files per second to compare the total against,
+   and by how many percent it may fall short before the run fails. */
+static double statsBaseline = 0;
+static double statsThreshold = 5;
+
+/* Print the throughput of a batch that took 'seconds', and the latency
+   percentiles of its files by size; then fail if it is slower than the
+   --stats-baseline allows. */
+static void printThroughput(double seconds) {
+    size_t files = statsLatencies.size();
+    double filesPerSecond = seconds > 0 ? files / seconds : 0;
+    double mbPerSecond = seconds > 0 ? totalStats.bytesRead / seconds / (1 << 20) : 0;
+
+    static const std::pair<const char *, uint64_t> buckets[] = {
+        { "<64KiB", 64 << 10 }, { "<1MiB", 1 << 20 }, { "<16MiB", 16 << 20 },
+        { ">=16MiB", std::numeric_limits<uint64_t>::max() },
+    };
+    std::vector<double> bucketLatencies[std::size(buckets)];
+    for (auto & [size, latency] : statsLatencies) {
+        size_t b = 0;
+        while (size >= buckets[b].second && b + 1 < std::size(buckets)) ++b;
+        bucketLatencies[b].push_back(latency);
+    }
+
+    /* Nearest-rank percentile of sorted latencies. */
+    auto percentile = [](const std::vector<double> & v, unsigned int p) {
+        return v[std::max<size_t>((v.size() * p + 99) / 100, 1) - 1];
+    };
+
+    if (statsFormat == StatsFormat::Json)
+        fprintf(stderr, ",\"throughput\":{\"build\":\"%s\",\"seconds\":%.6f,\"filesPerSecond\":%.3f,\"mbPerSecond\":%.3f",
+            jsonEscape(PATCHELF_BUILD_FLAVOR).c_str(), seconds, filesPerSecond, mbPerSecond);
+    else
+        fprintf(stderr, "stats: throughput (%s build) %.3f s, %.1f files/s, %.2f MB/s",
+            PATCHELF_BUILD_FLAVOR, seconds, filesPerSecond, mbPerSecond);
+    if (statsBaseline > 0) {
+        if (statsFormat == StatsFormat::Json)
+            fprintf(stderr, ",\"baseline\":%.3f,\"ratio\":%.4f", statsBaseline, filesPerSecond / statsBaseline);
+        else
+            fprintf(stderr, " (%.1f%% of baseline %.1f files/s)", 100 * filesPerSecond / statsBaseline, statsBaseline);
+    }
 
+    if (statsFormat == StatsFormat::Json)
+        fprintf(stderr, ",\"latency\":{");
+    bool first = true;
+    for (size_t b = 0; b < std::size(buckets); ++b) {
+        auto & v = bucketLatencies[b];
+        if (v.empty()) continue;
+        std::sort(v.begin(), v.end());
+        if (statsFormat == StatsFormat::Json)
+            fprintf(stderr, "%s\"%s\":{\"files\":%zu,\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f}",
+                first ? "" : ",", buckets[b].first, v.size(), percentile(v, 50), percentile(v, 90), percentile(v, 99));
+        else
+            fprintf(stderr, "; %s (%zu files): p50 %.3f ms, p90 %.3f ms, p99 %.3f ms",
+                buckets[b].first, v.size(), percentile(v, 50) * 1e3, percentile(v, 90) * 1e3, percentile(v, 99) * 1e3);
+        first = false;
+    }
+    fprintf(stderr, statsFormat == StatsFormat::Json ? "}}" : "\n");
+
+    if (statsBaseline > 0 && filesPerSecond < statsBaseline * (1 - statsThreshold / 100)) {
+        if (statsFormat == StatsFormat::Json)
+            fprintf(stderr, "}\n");
+        char message[160];
+        snprintf(message, sizeof(message), "throughput regressed: %.1f files/s is more than %g%% below the baseline of %.1f",
+            filesPerSecond, statsThreshold, statsBaseline);
+        error(message);
+    }
+}
+
+static void reportFile(const std::string & fileName) {
+    flushLog();
+
+    if (statsMode) {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+            fileStats.maxRssKiB = usage.ru_maxrss;
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (statsFormat == StatsFormat::Json && statsFilesReported > 0)
+            fprintf(stderr, ",");
+        printStats(fileName, fileStats);
+        totalStats += fileStats;
+        statsFilesReported++;
+        statsLatencies.emplace_back(fileStats.bytesRead,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - fileStats.started).count());
+    }
+}
+
+/* A patched file waiting for the background writer; the statistics of the
+   file travel along so that they can be completed and reported once the
+   write is done. */
+struct PendingWrite {
+    std::string outputFileName;
+    FileContents contents;
+    std::string fileName;
+    PatchStats stats;
+};
+
+/* Writes files on a separate thread for --pipeline, so that writing one
+   file overlaps with patching the next.  At most 'depth' files are queued,
+   which bounds the memory held by written-but-not-yet-flushed buffers. */
+class BackgroundWriter {
+public:
+    explicit BackgroundWriter(size_t depth) : depth(depth), thread([this]() { run(); }) { }
+
+    ~BackgroundWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+
+    void push(PendingWrite && write) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return queue.size() < depth || failure; });
+        if (failure)
+            std::rethrow_exception(failure);
+        queue.push_back(std::move(write));
+        changed.notify_all();
+    }
+
+    /* Wait until everything has been written. */
+    void finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return (queue.empty() && !busy) || failure; });
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+
+private:
+    void run() {
+        applyLowPriority();
+        flushLog();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [&]() { return !queue.empty() || done; });
+            if (queue.empty()) return;
+
+            PendingWrite write = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+            changed.notify_all();
+            lock.unlock();
+
+            try {
+                fileStats = std::move(write.stats);
+                writeFile(write.outputFileName, write.contents);
+                write.contents.reset();
+                reportFile(write.fileName);
+            } catch (...) {
+                flushLog();
+                lock.lock();
+                failure = std::current_exception();
+                busy = false;
+                changed.notify_all();
+                return;
+            }
+
+            lock.lock();
+            busy = false;
+            changed.notify_all();
+        }
+    }
+
+    size_t depth;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<PendingWrite> queue;
+    bool busy = false;
+    bool done = false;
+    std::exception_ptr failure;
+    std::thread thread;
+};
+
+static BackgroundWriter * backgroundWriter = nullptr;
+static unsigned int pipelineDepth = 0;
+
+/* Ask the kernel to start reading a file we're going to need soon. */
+static void prefetchFile(const std::string & fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void patchFile(const std::string & fileName) {
+    debug("patching ELF file '%s'\n", fileName.c_str());
+
+    fileStats = PatchStats();
+    if (statsMode) fileStats.started = std::chrono::steady_clock::now();
+    std::fill(std::begin(memoryLive), std::end(memoryLive), 0);
+    /* error() appends strerror(errno); don't let a failure of the previous
+       file leak into the messages of this one. */
+    errno = 0;
+
+    /* Files that haven't changed since they were indexed are not read. */
+    if (depGraphMode) {
+        size_t i = depGraphIndex.at(fileName.substr(depGraphRoot.size()));
+        if (auto entry = sysrootIndex.find(depGraphPaths[i], depGraphStamps[i])) {
+            debug("using the index entry of '%s'\n", fileName.c_str());
+            depGraphFiles[i] = sysrootIndex.load(*entry, buildIndexMode);
+            reportFile(fileName);
+            return;
+        }
+    }
+
+    TraceSpan fileSpan("file");
+    fileSpan.arg("name", fileName);
+
+    FileContents fileContents;
+    {
+        PhaseTimer timer(Phase::Read);
+        TraceSpan span("read");
+        fileContents = readFile(fileName);
+    }
+    if (fileContents)
+        fileSpan.arg("size", fileContents->size());
+    const std::string & outputFileName2 = outputFileName.empty() ? fileName : outputFileName;
+
+    if (queryMode) {
+        /* A file that can't be read or parsed gets a record with the
+           error instead of ending the batch, as with --dep-graph. */
+        try {
+            if (!fileContents) error("cannot read '" + fileName + "'");
+            printDependencies(fileName, readDependencies(fileContents));
+        } catch (std::exception & e) {
+            std::string record = "{\"file\":" + jsonString(fileName) + ",\"error\":" + jsonString(e.what()) + "}\n";
+            fwrite(record.data(), 1, record.size(), stdout);
+        }
+        reportFile(fileName);
+        return;
+    }
+
+    if (!fileContents && !depGraphMode)
+        error("cannot read '" + fileName + "'");
+
+    if (!symbolQueries.empty()) {
+        printSymbolPresence(fileName, fileContents);
+        reportFile(fileName);
+        return;
+    }
+
+    if (!variants.empty()) {
         if (getElfType(fileContents).is32Bit)
-            patchElf2(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents), fileContents, outputFileName2);
+            patchVariants(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents), fileContents);
         else
-            patchElf2(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents), fileContents, outputFileName2);
+            patchVariants(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents), fileContents);
+        reportFile(fileName);
+        return;
     }
+
+    if (depGraphMode) {
+        /* Files that turn out not to be usable ELF objects are left out
+           of the graph rather than failing the whole tree. */
+        try {
+            if (!fileContents) error("cannot read file");
+            depGraphFiles[depGraphIndex.at(fileName.substr(depGraphRoot.size()))] =
+                readDependencies(fileContents, buildIndexMode);
+        } catch (std::exception & e) {
+            warn("skipping '%s': %s\n", fileName.c_str(), e.what());
+        }
+        reportFile(fileName);
+        return;
+    }
+
+    FileContents output;
+    if (getElfType(fileContents).is32Bit)
+        output = patchElf2(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents), fileContents);
+    else
+        output = patchElf2(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents), fileContents);
+
+    if (output && backgroundWriter) {
+        flushLog();
+        backgroundWriter->push({ outputFileName2, std::move(output), fileName, fileStats });
+        return;
+    }
+
+    if (output)
+        writeFile(outputFileName2, output);
+
+    reportFile(fileName);
+}
+
+static unsigned int jobs = 1;
+static uint64_t maxMemory = 0; /* 0 means no budget */
+
+/* Rough upper bound of the heap needed to patch a file of the given size.
+   The buffer grows in place by up to BufferPool::headroom; beyond that
+   the resize() in shiftFile() or when appending replaced sections may
+   double its capacity.  On top of that come the appended sections and
+   headers (at most a large page plus the new strings) and the replaced
+   section copies. */
+static uint64_t estimatePeakMemory(uint64_t fileSize) {
+    uint64_t growth = 0x10000;
+    for (auto & i : neededLibsToReplace)
+        growth += 2 * (i.second.size() + 1);
+    if (growth <= BufferPool::headroom)
+        return fileSize + BufferPool::headroom + growth;
+    return 2 * (fileSize + growth) + growth;
+}
+
+/* Patch the files on 'jobs' worker threads.  With a --max-memory budget,
+   a job is only started while the estimated peaks of all running jobs fit
+   into it: the next file in order is preferred, but when it doesn't fit,
+   the largest waiting file that does is started instead so that the
+   workers stay busy.  A file exceeding the whole budget runs alone. */
+static void patchElfParallel() {
+    std::vector<uint64_t> estimates(fileNames.size());
+    std::multimap<uint64_t, size_t> bySize;
+    std::vector<std::multimap<uint64_t, size_t>::iterator> bySizePos(fileNames.size());
+    for (size_t i = 0; i < fileNames.size(); ++i) {
+        struct stat st;
+        estimates[i] = stat(fileNames[i].c_str(), &st) == 0 ? estimatePeakMemory(st.st_size) : 0;
+        bySizePos[i] = bySize.emplace(estimates[i], i);
+    }
+
+    std::mutex mutex;
+    std::condition_variable admitted;
+    std::vector<bool> taken(fileNames.size());
+    size_t nextInOrder = 0;
+    uint64_t memoryInUse = 0;
+    unsigned int running = 0;
+    std::exception_ptr failure;
+
+    auto take = [&](size_t i) {
+        taken[i] = true;
+        bySize.erase(bySizePos[i]);
+        memoryInUse += estimates[i];
+        running++;
+        return i;
+    };
+
+    /* Called with 'mutex' held; returns the index of the next job to run,
+       or nothing if there is no more work. */
+    auto admit = [&](std::unique_lock<std::mutex> & lock) -> std::optional<size_t> {
+        while (true) {
+            if (failure || bySize.empty()) return {};
+            while (taken[nextInOrder]) nextInOrder++;
+
+            if (maxMemory == 0 || running == 0 || memoryInUse + estimates[nextInOrder] <= maxMemory)
+                return take(nextInOrder);
+
+            if (memoryInUse < maxMemory) {
+                auto fit = bySize.upper_bound(maxMemory - memoryInUse);
+                if (fit != bySize.begin())
+                    return take(std::prev(fit)->second);
+            }
+
+            admitted.wait(lock);
+        }
+    };
+
+    auto worker = [&]() {
+        applyLowPriority();
+        flushLog();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (auto i = admit(lock)) {
+            lock.unlock();
+            try {
+                patchFile(fileNames[*i]);
+            } catch (...) {
+                flushLog();
+                lock.lock();
+                if (!failure) failure = std::current_exception();
+                lock.unlock();
+            }
+            lock.lock();
+            memoryInUse -= estimates[*i];
+            running--;
+            admitted.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < std::min<size_t>(jobs, fileNames.size()); ++i)
+        threads.emplace_back(worker);
+    for (auto & t : threads)
+        t.join();
+
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+static void patchElf() {
+    /* One buffer per file that can be in flight at the same time. */
+    bufferPool.setCapacity(std::max(jobs, 1u) + pipelineDepth + 1);
+
+    if (statsMode && statsFormat == StatsFormat::Json)
+        fprintf(stderr, "{\"files\":[");
+    auto batchStarted = std::chrono::steady_clock::now();
+
+    if (jobs > 1 && fileNames.size() > 1) {
+        patchElfParallel();
+    } else if (pipelineDepth > 0) {
+        /* With --jobs the workers already overlap I/O and CPU work, so
+           pipelining only applies to sequential runs. */
+        applyLowPriority();
+        BackgroundWriter writer(pipelineDepth);
+        backgroundWriter = &writer;
+        try {
+            for (size_t i = 0; i < fileNames.size(); ++i) {
+                /* Keep the next 'pipelineDepth' files in flight. */
+                if (i == 0)
+                    for (size_t j = 1; j <= pipelineDepth && j < fileNames.size(); ++j)
+                        prefetchFile(fileNames[j]);
+                else if (i + pipelineDepth < fileNames.size())
+                    prefetchFile(fileNames[i + pipelineDepth]);
+
+                patchFile(fileNames[i]);
+            }
+            writer.finish();
+        } catch (...) {
+            backgroundWriter = nullptr;
+            throw;
+        }
+        backgroundWriter = nullptr;
+    } else {
+        applyLowPriority();
+        for (const auto & fileName : fileNames)
+            patchFile(fileName);
+    }
+
+    if (statsMode) {
+        if (statsFormat == StatsFormat::Json)
+            fprintf(stderr, "],\"total\":");
+        printStats("total", totalStats, fileNames.size());
+        printThroughput(std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStarted).count());
+        if (statsFormat == StatsFormat::Json)
+            fprintf(stderr, "}\n");
+    }
+}
+
+/* Symbolic links under the --dep-graph root by their path inside it,
+   and the ELF files found there before they are sorted. */
+static std::unordered_map<std::string, std::string> depGraphLinks;
+static std::vector<std::pair<std::string, FileStamp>> depGraphScanned;
+
+static int scanTreeEntry(const char * fpath, const struct stat * st, int type, struct FTW *) {
+    std::string path = fpath + std::min(depGraphRoot.size(), strlen(fpath));
+
+    if (type == FTW_SL) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(fpath, target, sizeof(target));
+        if (n > 0) depGraphLinks.emplace(path, std::string(target, n));
+    } else if (type == FTW_F && S_ISREG(st->st_mode) && st->st_size >= (off_t) sizeof(Elf32_Ehdr)) {
+        /* Only read the magic here; the files are parsed on the workers. */
+        int fd = open(fpath, O_RDONLY);
+        if (fd == -1) return 0;
+        unsigned char magic[SELFMAG];
+        bool elf = read(fd, magic, SELFMAG) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+        close(fd);
+        if (elf) {
+            FileStamp stamp;
+            stamp.inode = st->st_ino;
+            stamp.mtimeNs = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+            stamp.size = st->st_size;
+            depGraphScanned.emplace_back(path, stamp);
+        }
+    }
+    return 0;
+}
+
+static void splitPath(const std::string & path, std::deque<std::string> & parts, bool front) {
+    std::vector<std::string> split;
+    for (size_t begin = 0, end; begin <= path.size(); begin = end + 1) {
+        end = path.find('/', begin);
+        if (end == std::string::npos) end = path.size();
+        if (end > begin) split.push_back(path.substr(begin, end - begin));
+    }
+    if (front)
+        parts.insert(parts.begin(), split.begin(), split.end());
+    else
+        parts.insert(parts.end(), split.begin(), split.end());
+}
+
+/* Resolve the symbolic links in an absolute path as the loader would
+   if the --dep-graph root were "/"; empty on a link loop. */
+static std::string resolveInTree(const std::string & path) {
+    std::deque<std::string> todo;
+    splitPath(path, todo, false);
+
+    std::string resolved;
+    std::vector<size_t> lengths;
+    unsigned int links = 0;
+    while (!todo.empty()) {
+        auto part = std::move(todo.front());
+        todo.pop_front();
+        if (part == ".") continue;
+        if (part == "..") {
+            if (!lengths.empty()) {
+                resolved.resize(lengths.back());
+                lengths.pop_back();
+            }
+            continue;
+        }
+        lengths.push_back(resolved.size());
+        resolved += "/" + part;
+
+        auto link = depGraphLinks.find(resolved);
+        if (link == depGraphLinks.end()) continue;
+        if (++links > 40) return "";
+        if (link->second[0] == '/') {
+            resolved.clear();
+            lengths.clear();
+        } else {
+            resolved.resize(lengths.back());
+            lengths.pop_back();
+        }
+        splitPath(link->second, todo, true);
+    }
+    return resolved.empty() ? "/" : resolved;
+}
+
+/* Directories searched after RPATH/RUNPATH, by machine: the multiarch
+   directories of the usual distributions, then the traditional ones. */
+static std::vector<std::string> defaultLibraryDirs(const ElfDependencies & deps) {
+    static const std::pair<unsigned int, const char *> triplets[] = {
+        { EM_X86_64, "x86_64-linux-gnu" },
+        { EM_386, "i386-linux-gnu" },
+        { EM_AARCH64, "aarch64-linux-gnu" },
+        { EM_ARM, "arm-linux-gnueabihf" },
+        { EM_PPC64, "powerpc64le-linux-gnu" },
+        { EM_S390, "s390x-linux-gnu" },
+        { EM_RISCV, "riscv64-linux-gnu" },
+    };
+
+    std::vector<std::string> dirs;
+    for (auto & [machine, triplet] : triplets)
+        if (machine == deps.machine) {
+            dirs.push_back(std::string("/lib/") + triplet);
+            dirs.push_back(std::string("/usr/lib/") + triplet);
+        }
+    if (deps.elfClass == 64) {
+        dirs.push_back("/lib64");
+        dirs.push_back("/usr/lib64");
+    }
+    dirs.push_back("/lib");
+    dirs.push_back("/usr/lib");
+    return dirs;
+}
+
+/* Expand the dynamic string tokens of an RPATH/RUNPATH entry; empty if
+   it uses one we can't know, such as $PLATFORM. */
+static std::string expandSearchDir(std::string dir, const std::string & origin, const ElfDependencies & deps) {
+    const std::pair<const char *, std::string> tokens[] = {
+        { "ORIGIN", origin },
+        { "LIB", deps.elfClass == 64 ? "lib64" : "lib" },
+    };
+    for (size_t pos = dir.find('$'); pos != std::string::npos; pos = dir.find('$', pos)) {
+        bool braced = dir.compare(pos + 1, 1, "{") == 0;
+        bool expanded = false;
+        for (auto & [name, value] : tokens) {
+            std::string token = braced ? std::string("{") + name + "}" : name;
+            if (dir.compare(pos + 1, token.size(), token) == 0) {
+                dir.replace(pos, token.size() + 1, value);
+                pos += value.size();
+                expanded = true;
+                break;
+            }
+        }
+        if (!expanded) return "";
+    }
+    return dir;
+}
+
+/* The loader's cache of library paths, /etc/ld.so.cache, mapped into
+   memory.  Both the old "ld.so-1.7.0" format and the "glibc-ld.so.cache"
+   one (alone or following the old one) are understood.  The entries are
+   sorted by name as compared by libcmp(), in descending order, so a name
+   is found by binary search; several entries can share a name. */
+class LdSoCache {
+public:
+    LdSoCache() = default;
+    LdSoCache(const LdSoCache &) = delete;
+    LdSoCache & operator=(const LdSoCache &) = delete;
+    ~LdSoCache() {
+        if (map) munmap(map, mapSize);
+    }
+
+    /* Map the file; false if it doesn't exist or isn't a usable cache. */
+    bool open(const std::string & fileName) {
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mapSize = st.st_size;
+            map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) map = nullptr;
+        }
+        close(fd);
+        if (map && !parse()) {
+            warn("ignoring unrecognised loader cache '%s'\n", fileName.c_str());
+            munmap(map, mapSize);
+            map = nullptr;
+        }
+        return map;
+    }
+
+    /* Call f with the path of every entry for 'name' usable by objects
+       of the given class and machine, in the loader's order of preference,
+       until it returns true. */
+    template<class F>
+    bool find(const std::string & name, const ElfDependencies & deps, F f) const {
+        if (!map) return false;
+        uint32_t flags = defaultFlags(deps);
+
+        /* Binary search as in glibc's search_cache(), then back up to the
+           first entry of that name. */
+        size_t left = 0, right = count;
+        while (left < right) {
+            size_t middle = (left + right) / 2;
+            int cmp = libcmp(name.c_str(), key(middle));
+            if (cmp < 0) left = middle + 1;
+            else right = middle;
+        }
+
+        for (size_t i = left; i < count && libcmp(name.c_str(), key(i)) == 0; ++i) {
+            uint32_t entryFlags = entry(i, 0);
+            if ((entryFlags & flagTypeMask) != flagElfLibc6 && entryFlags != flagElf) continue;
+            if (flags && entryFlags != flags && entryFlags != flagElf) continue;
+            /* Variants for CPUs with extra capabilities (legacy hwcaps, or
+               a glibc-hwcaps subdirectory in the new format) are only used
+               on such a CPU; we can't know the target's, so resolve to the
+               baseline library like the loader does on a plain CPU. */
+            if (newFormat && hwcap(i)) {
+                debug("skipping %s in loader cache: %s\n", name.c_str(), hwcapName(i).c_str());
+                continue;
+            }
+            auto value = string(entry(i, 2));
+            if (value && f(std::string(value)))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    /* Entry flags, from glibc's ldconfig.h. */
+    static const uint32_t flagElf = 0x0001;
+    static const uint32_t flagElfLibc6 = 0x0003;
+    static const uint32_t flagTypeMask = 0x00ff;
+    static const uint64_t hwcapExtension = 1ULL << 62;
+    static const uint32_t extensionMagic = 0xeaa42174;
+    static const uint32_t extensionTagHwcaps = 1;
+
+    void * map = nullptr;
+    size_t mapSize = 0;
+    bool newFormat = false;
+    const char * entries = nullptr;
+    size_t entrySize = 0;
+    size_t count = 0;
+    const char * strings = nullptr; /* base of string offsets */
+    size_t stringsSize = 0;
+    const uint32_t * hwcapNames = nullptr;
+    size_t hwcapNameCount = 0;
+
+    /* Entry flags of the usual libraries for a class and machine, as
+       _DL_CACHE_DEFAULT_ID; 0 if unknown, in which case only the class
+       and machine of the candidate file itself are checked. */
+    static uint32_t defaultFlags(const ElfDependencies & deps) {
+        switch (deps.machine) {
+            case EM_386: return flagElfLibc6;
+            case EM_X86_64: return deps.elfClass == 64 ? 0x0303 : 0x0803;
+            case EM_S390: return deps.elfClass == 64 ? 0x0403 : flagElfLibc6;
+            case EM_PPC64: return 0x0503;
+            case EM_PPC: return flagElfLibc6;
+            case EM_AARCH64: return 0x0a03;
+            case EM_RISCV: return deps.elfClass == 64 ? 0x1003 : 0;
+            default: return 0;
+        }
+    }
+
+    /* glibc's _dl_cache_libcmp(): runs of digits compare numerically. */
+    static int libcmp(const char * p1, const char * p2) {
+        while (*p1 != '\0') {
+            if (isdigit((unsigned char) *p1)) {
+                if (!isdigit((unsigned char) *p2)) return 1;
+                unsigned long val1 = 0, val2 = 0;
+                while (isdigit((unsigned char) *p1)) val1 = val1 * 10 + *p1++ - '0';
+                while (isdigit((unsigned char) *p2)) val2 = val2 * 10 + *p2++ - '0';
+                if (val1 != val2) return val1 < val2 ? -1 : 1;
+            } else if (isdigit((unsigned char) *p2)) {
+                return -1;
+            } else if (*p1 != *p2) {
+                return (unsigned char) *p1 - (unsigned char) *p2;
+            } else {
+                ++p1;
+                ++p2;
+            }
+        }
+        return (unsigned char) *p1 - (unsigned char) *p2;
+    }
+
+    uint32_t entry(size_t i, size_t field) const {
+        uint32_t v;
+        memcpy(&v, entries + i * entrySize + field * sizeof(uint32_t), sizeof(v));
+        return v;
+    }
+
+    uint64_t hwcap(size_t i) const {
+        uint64_t v;
+        memcpy(&v, entries + i * entrySize + 4 * sizeof(uint32_t), sizeof(v));
+        return v;
+    }
+
+    std::string hwcapName(size_t i) const {
+        uint64_t h = hwcap(i);
+        if ((h >> 32) == (hwcapExtension >> 32) && (uint32_t) h < hwcapNameCount)
+            if (auto name = string(hwcapNames[(uint32_t) h]))
+                return std::string("glibc-hwcaps/") + name;
+        return "legacy hwcap";
+    }
+
+    const char * string(uint32_t offset) const {
+        if (offset >= stringsSize) return nullptr;
+        if (!memchr(strings + offset, 0, stringsSize - offset)) return nullptr;
+        return strings + offset;
+    }
+
+    const char * key(size_t i) const {
+        auto k = string(entry(i, 1));
+        return k ? k : "";
+    }
+
+    bool parse() {
+        static const char oldMagic[] = "ld.so-1.7.0";
+        static const char newMagic[] = "glibc-ld.so.cache1.1";
+        const size_t oldHeader = 16, oldEntry = 12, newHeader = 48, newEntry = 24;
+        auto base = (const char *) map;
+        uint32_t n;
+
+        size_t newStart = 0;
+        if (mapSize >= oldHeader && memcmp(base, oldMagic, sizeof(oldMagic) - 1) == 0) {
+            memcpy(&n, base + 12, sizeof(n));
+            if (n > (mapSize - oldHeader) / oldEntry) return false;
+            newStart = roundUp(oldHeader + n * oldEntry, 8);
+            if (newStart + newHeader > mapSize
+                || memcmp(base + newStart, newMagic, sizeof(newMagic) - 1) != 0) {
+                /* Only the old format: offsets are relative to the end
+                   of the entries. */
+                entries = base + oldHeader;
+                entrySize = oldEntry;
+                count = n;
+                strings = entries + n * oldEntry;
+                stringsSize = mapSize - (strings - base);
+                return true;
+            }
+        }
+
+        if (newStart + newHeader > mapSize || memcmp(base + newStart, newMagic, sizeof(newMagic) - 1) != 0)
+            return false;
+
+        /* The new format: offsets are relative to its header. */
+        auto header = base + newStart;
+        memcpy(&n, header + 20, sizeof(n));
+        if (n > (mapSize - newStart - newHeader) / newEntry) return false;
+        newFormat = true;
+        entries = header + newHeader;
+        entrySize = newEntry;
+        count = n;
+        strings = header;
+        stringsSize = mapSize - newStart;
+
+        uint32_t extension;
+        memcpy(&extension, header + 32, sizeof(extension));
+        if (extension != 0 && extension % 4 == 0 && extension <= stringsSize - 8) {
+            uint32_t ext[2];
+            memcpy(ext, header + extension, sizeof(ext));
+            for (uint32_t s = 0; ext[0] == extensionMagic && s < ext[1]
+                && extension + 8 + (s + 1) * 16 <= stringsSize; ++s) {
+                uint32_t section[4]; /* tag, flags, offset, size */
+                memcpy(section, header + extension + 8 + s * 16, sizeof(section));
+                if (section[0] == extensionTagHwcaps && section[2] % 4 == 0
+                    && section[2] <= stringsSize && section[3] <= stringsSize - section[2]) {
+                    hwcapNames = (const uint32_t *) (header + section[2]);
+                    hwcapNameCount = section[3] / sizeof(uint32_t);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+static LdSoCache ldSoCache;
+
+/* Find the library a DT_NEEDED entry of file 'i' loads, following the
+   loader's search order: RPATH (unless there is a RUNPATH), RUNPATH,
+   the root's /etc/ld.so.cache, then the default directories.
+   Candidates of another class or machine are skipped, as the loader
+   does.  The RPATH of the objects
+   that loaded file 'i' is not consulted, so that the result doesn't
+   depend on the path by which 'i' was reached and can be shared.  A
+   relative name with a slash is opened by the loader relative to the
+   working directory of the process, which isn't known here, so it is
+   reported as unresolved.
+
+   When no file of that name is found, the library of the tree whose
+   DT_SONAME is the name (the first by path) is taken instead: the loader
+   accepts an object already loaded under that soname, and this is the
+   only candidate the tree offers.  The soname table of the index covers
+   the files taken from it; 'parsedSonames' holds the others. */
+static std::optional<size_t> resolveNeeded(size_t i, const std::string & name,
+    std::unordered_map<std::string, std::optional<size_t>> & cache,
+    const std::unordered_multimap<std::string, size_t> & parsedSonames)
+{
+    auto & deps = depGraphFiles[i];
+    auto & path = depGraphPaths[i];
+
+    auto candidate = [&](const std::string & file) -> std::optional<size_t> {
+        auto cached = cache.find(file);
+        if (cached == cache.end()) {
+            auto j = depGraphIndex.find(resolveInTree(file));
+            cached = cache.emplace(file, j == depGraphIndex.end() ? std::nullopt : std::optional(j->second)).first;
+        }
+        auto j = cached->second;
+        if (j && depGraphFiles[*j].elfClass == deps.elfClass && depGraphFiles[*j].machine == deps.machine)
+            return j;
+        return {};
+    };
+
+    if (name.find('/') != std::string::npos) {
+        if (name[0] != '/') return {};
+        return candidate(name);
+    }
+
+    std::string origin = path.substr(0, path.rfind('/'));
+
+    std::vector<std::string> dirs;
+    auto addDirs = [&](const std::optional<std::string> & searchPath) {
+        if (!searchPath) return;
+        for (size_t begin = 0, end; begin <= searchPath->size(); begin = end + 1) {
+            end = searchPath->find(':', begin);
+            if (end == std::string::npos) end = searchPath->size();
+            auto dir = expandSearchDir(searchPath->substr(begin, end - begin), origin, deps);
+            if (!dir.empty()) dirs.push_back(dir);
+        }
+    };
+    if (!deps.runpath) addDirs(deps.rpath);
+    addDirs(deps.runpath);
+
+    for (auto & dir : dirs)
+        if (auto j = candidate(dir + "/" + name))
+            return j;
+
+    std::optional<size_t> cached;
+    if (ldSoCache.find(name, deps, [&](const std::string & file) { return (bool) (cached = candidate(file)); }))
+        return cached;
+
+    for (auto & dir : defaultLibraryDirs(deps))
+        if (auto j = candidate(dir + "/" + name))
+            return j;
+
+    std::optional<size_t> bySoname;
+    auto consider = [&](size_t j) {
+        if (depGraphFiles[j].soname == name && depGraphFiles[j].elfClass == deps.elfClass
+            && depGraphFiles[j].machine == deps.machine && (!bySoname || j < *bySoname))
+            bySoname = j;
+    };
+    /* An index entry only counts while the file still has that soname. */
+    sysrootIndex.forEachWithSoname(name, [&](std::string_view file) {
+        auto j = depGraphIndex.find(std::string(file));
+        if (j != depGraphIndex.end()) consider(j->second);
+    });
+    auto [first, last] = parsedSonames.equal_range(name);
+    for (; first != last; ++first)
+        consider(first->second);
+    return bySoname;
+}
+
+/* Build the dependency graph of the ELF files parsed for --dep-graph and
+   print one JSON line per file with its direct dependencies, its
+   transitive closure and the entries that couldn't be resolved.  The
+   closures are computed once per strongly connected component (Tarjan),
+   whose members all share one, and reused by everything depending on
+   it. */
+static void printDepGraph() {
+    size_t n = depGraphPaths.size();
+    std::vector<std::vector<std::optional<size_t>>> edges(n);
+    {
+        std::unordered_multimap<std::string, size_t> parsedSonames;
+        for (size_t i = 0; i < n; ++i)
+            if (depGraphFiles[i].soname && !sysrootIndex.find(depGraphPaths[i], depGraphStamps[i]))
+                parsedSonames.emplace(*depGraphFiles[i].soname, i);
+
+        std::unordered_map<std::string, std::optional<size_t>> cache;
+        for (size_t i = 0; i < n; ++i)
+            for (auto & name : depGraphFiles[i].needed)
+                edges[i].push_back(resolveNeeded(i, name, cache, parsedSonames));
+    }
+
+    const size_t unvisited = std::numeric_limits<size_t>::max();
+    std::vector<size_t> index(n, unvisited), lowLink(n), component(n);
+    std::vector<bool> onStack(n);
+    std::vector<size_t> stack;
+    std::vector<std::vector<size_t>> closures;
+    std::vector<std::vector<std::string>> unresolved;
+    size_t nextIndex = 0;
+
+    /* The depth-first search keeps its own call stack of (file, next
+       edge) pairs, since a long dependency chain would overflow the
+       real one. */
+    std::vector<std::pair<size_t, size_t>> calls;
+
+    auto enter = [&](size_t v) {
+        index[v] = lowLink[v] = nextIndex++;
+        stack.push_back(v);
+        onStack[v] = true;
+        calls.emplace_back(v, 0);
+    };
+
+    /* Called when all edges of v are done. */
+    auto leave = [&](size_t v) {
+        if (lowLink[v] != index[v]) return;
+
+        /* v is the root of a component; every component it depends on
+           is complete by now. */
+        size_t c = closures.size();
+        std::vector<size_t> members;
+        do {
+            members.push_back(stack.back());
+            onStack[stack.back()] = false;
+            component[stack.back()] = c;
+            stack.pop_back();
+        } while (members.back() != v);
+
+        std::vector<size_t> closure;
+        std::vector<std::string> missing;
+        for (auto m : members)
+            for (size_t e = 0; e < edges[m].size(); ++e) {
+                auto & w = edges[m][e];
+                if (!w) {
+                    missing.push_back(depGraphFiles[m].needed[e]);
+                    continue;
+                }
+                closure.push_back(*w);
+                if (component[*w] != c && index[*w] != unvisited && !onStack[*w]) {
+                    auto & sub = closures[component[*w]];
+                    closure.insert(closure.end(), sub.begin(), sub.end());
+                    auto & subMissing = unresolved[component[*w]];
+                    missing.insert(missing.end(), subMissing.begin(), subMissing.end());
+                }
+            }
+        std::sort(closure.begin(), closure.end());
+        closure.erase(std::unique(closure.begin(), closure.end()), closure.end());
+        std::sort(missing.begin(), missing.end());
+        missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+        closures.push_back(std::move(closure));
+        unresolved.push_back(std::move(missing));
+    };
+
+    auto visit = [&](size_t root) {
+        enter(root);
+        while (!calls.empty()) {
+            auto v = calls.back().first;
+            auto e = calls.back().second++;
+            if (e < edges[v].size()) {
+                auto & w = edges[v][e];
+                if (!w) continue;
+                if (index[*w] == unvisited)
+                    enter(*w);
+                else if (onStack[*w])
+                    lowLink[v] = std::min(lowLink[v], index[*w]);
+                continue;
+            }
+            calls.pop_back();
+            leave(v);
+            if (!calls.empty()) {
+                auto parent = calls.back().first;
+                lowLink[parent] = std::min(lowLink[parent], lowLink[v]);
+            }
+        }
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+        if (depGraphFiles[i].elfClass == 0) continue; /* not parsed */
+        if (index[i] == unvisited) visit(i);
+
+        std::string record = "{\"file\":" + jsonString(depGraphPaths[i])
+            + ",\"soname\":" + jsonString(depGraphFiles[i].soname) + ",\"needed\":[";
+        for (size_t e = 0; e < edges[i].size(); ++e)
+            record += std::string(e ? "," : "") + "{\"name\":" + jsonString(depGraphFiles[i].needed[e])
+                + ",\"path\":" + (edges[i][e] ? jsonString(depGraphPaths[*edges[i][e]]) : "null") + "}";
+        record += "],\"closure\":[";
+        bool first = true;
+        for (auto j : closures[component[i]]) {
+            if (j == i) continue;
+            record += (first ? "" : ",") + jsonString(depGraphPaths[j]);
+            first = false;
+        }
+        record += "],\"unresolved\":[";
+        auto & missing = unresolved[component[i]];
+        for (size_t j = 0; j < missing.size(); ++j)
+            record += (j ? "," : "") + jsonString(missing[j]);
+        record += "]}\n";
+        fwrite(record.data(), 1, record.size(), stdout);
+    }
+}
+
+/* Find the ELF files under the --dep-graph or --build-index root and
+   parse them with the usual --jobs machinery, taking the entries of
+   unchanged files from the index if there is one. */
+static void scanTree() {
+    std::string root = depGraphRoot.empty() ? "/" : depGraphRoot;
+    if (nftw(root.c_str(), scanTreeEntry, 64, FTW_PHYS) != 0)
+        error("cannot scan '" + root + "'");
+    std::sort(depGraphScanned.begin(), depGraphScanned.end(),
+        [](auto & a, auto & b) { return a.first < b.first; });
+
+    for (auto & [path, stamp] : depGraphScanned) {
+        depGraphIndex.emplace(path, fileNames.size());
+        fileNames.push_back(depGraphRoot + path);
+        depGraphPaths.push_back(std::move(path));
+        depGraphStamps.push_back(stamp);
+    }
+    depGraphScanned.clear();
+    depGraphFiles.resize(fileNames.size());
+
+    if (indexFileName.empty())
+        indexFileName = depGraphRoot + "/.patchelf-index";
+    if (sysrootIndex.open(indexFileName))
+        debug("using index '%s'\n", indexFileName.c_str());
+
+    patchElf();
+}
+
+/* --dep-graph: resolve and print the graph of the tree. */
+static void buildDepGraph() {
+    if (ldSoCache.open(depGraphRoot + "/etc/ld.so.cache"))
+        debug("using the loader cache of '%s'\n", depGraphRoot.empty() ? "/" : depGraphRoot.c_str());
+    scanTree();
+    printDepGraph();
+    flushLog();
+}
+
+/* --build-index: write the parsed files of the tree as an index for
+   later runs.  The index is written to a temporary file and renamed, so
+   that a concurrent run (or this one, through the mapping) never sees
+   it half written. */
+static void buildIndex() {
+    scanTree();
+
+    std::string strings(1, '\0');
+    std::unordered_map<std::string, uint32_t> interned;
+    auto intern = [&](const std::string & s) -> uint32_t {
+        auto i = interned.find(s);
+        if (i != interned.end()) return i->second;
+        if (strings.size() + s.size() + 1 >= indexNoString)
+            error("too many strings for an index");
+        uint32_t offset = strings.size();
+        strings.append(s.c_str(), s.size() + 1);
+        interned.emplace(s, offset);
+        return offset;
+    };
+    auto internOptional = [&](const std::optional<std::string> & s) {
+        return s ? intern(*s) : indexNoString;
+    };
+
+    std::vector<IndexFile> files;
+    std::vector<uint32_t> needed;
+    std::vector<IndexSymbol> symbols;
+    for (size_t i = 0; i < depGraphPaths.size(); ++i) {
+        auto & deps = depGraphFiles[i];
+        if (deps.elfClass == 0) continue; /* not parsed */
+
+        /* Sorted before interning, so that the index doesn't depend on
+           whether an entry was parsed or taken from the previous one. */
+        std::sort(deps.symbols.begin(), deps.symbols.end(), [](auto & a, auto & b) {
+            return std::tie(a.hash, a.version, a.hidden) < std::tie(b.hash, b.version, b.hidden);
+        });
+
+        IndexFile file = {};
+        file.stamp = depGraphStamps[i];
+        file.path = intern(depGraphPaths[i]);
+        file.soname = internOptional(deps.soname);
+        file.rpath = internOptional(deps.rpath);
+        file.runpath = internOptional(deps.runpath);
+        file.elfClass = deps.elfClass;
+        file.machine = deps.machine;
+
+        file.firstNeeded = needed.size();
+        file.neededCount = deps.needed.size();
+        for (auto & name : deps.needed)
+            needed.push_back(intern(name));
+
+        file.firstSymbol = symbols.size();
+        file.symbolCount = deps.symbols.size();
+        for (auto & sym : deps.symbols)
+            symbols.push_back({ sym.hash, intern(sym.version) | (sym.hidden ? indexSymbolHidden : 0) });
+
+        files.push_back(file);
+    }
+
+    uint32_t sonameSlots = 16;
+    while (sonameSlots < 2 * files.size()) sonameSlots *= 2;
+    std::vector<uint32_t> sonames(sonameSlots);
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        if (files[i].soname == indexNoString) continue;
+        uint32_t slot = gnuHash(strings.c_str() + files[i].soname) & (sonameSlots - 1);
+        while (sonames[slot]) slot = (slot + 1) & (sonameSlots - 1);
+        sonames[slot] = i + 1;
+    }
+
+    IndexHeader header = {};
+    memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.fileCount = files.size();
+    header.neededCount = needed.size();
+    header.symbolCount = symbols.size();
+    header.sonameSlots = sonameSlots;
+    header.stringsSize = strings.size();
+
+    auto contents = std::make_shared<std::vector<unsigned char>>();
+    auto append = [&](const void * data, size_t size) {
+        contents->resize(roundUp(contents->size(), 8), 0);
+        uint64_t offset = contents->size();
+        contents->insert(contents->end(), (const unsigned char *) data, (const unsigned char *) data + size);
+        return offset;
+    };
+    append(&header, sizeof(header));
+    header.files = append(files.data(), files.size() * sizeof(IndexFile));
+    header.needed = append(needed.data(), needed.size() * sizeof(uint32_t));
+    header.symbols = append(symbols.data(), symbols.size() * sizeof(IndexSymbol));
+    header.sonames = append(sonames.data(), sonames.size() * sizeof(uint32_t));
+    header.strings = append(strings.data(), strings.size());
+    memcpy(contents->data(), &header, sizeof(header));
+
+    std::string tempName = indexFileName + ".tmp";
+    writeFile(tempName, contents);
+    chmod(tempName.c_str(), 0644);
+    if (rename(tempName.c_str(), indexFileName.c_str()) != 0)
+        error("cannot rename '" + tempName + "' to '" + indexFileName + "'");
+    debug("wrote index '%s' of %zu files\n", indexFileName.c_str(), files.size());
+}
+
+static void writeTrace(const std::string & fileName) {
+    FILE * f = fopen(fileName.c_str(), "w");
+    if (!f)
+        error("cannot open trace file '" + fileName + "'");
+
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"patchelf\"}}", pid);
+    for (auto & e : traceEvents)
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}",
+            e.name, pid, e.tid, (long long) e.begin, (long long) e.duration, e.args.c_str());
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0)
+        error("cannot write trace file '" + fileName + "'");
+}
+
+/* Parse a plain decimal count, at most 'max'. */
+[[nodiscard]] static uint64_t parseCount(const std::string & arg, uint64_t max) {
+    uint64_t n = 0;
+    for (char c : arg) {
+        uint64_t digit = c - '0';
+        if (c < '0' || c > '9' || digit > max || n > (max - digit) / 10)
+            error("invalid number '" + arg + "', expected 0 to " + std::to_string(max));
+        n = n * 10 + digit;
+    }
+    if (arg.empty())
+        error("invalid number '', expected 0 to " + std::to_string(max));
+    return n;
+}
+
+/* Parse a decimal number with an optional binary K/M/G/T suffix. */
+[[nodiscard]] static uint64_t parseSize(const std::string & arg) {
+    size_t pos = 0;
+    uint64_t n = 0;
+    try {
+        n = std::stoull(arg, &pos);
+    } catch (std::exception &) {
+        error("invalid number '" + arg + "'");
+    }
+
+    unsigned int shift = 0;
+    if (pos < arg.size()) {
+        switch (arg[pos++]) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+            case 't': case 'T': shift = 40; break;
+            default: pos = std::string::npos;
+        }
+    }
+    if (pos != arg.size() || (shift && n > (std::numeric_limits<uint64_t>::max() >> shift)))
+        error("invalid number '" + arg + "'");
+
+    return n << shift;
 }
 
 [[nodiscard]] static std::string resolveArgument(const char *arg) {
@@ -1322,13 +3743,37 @@ static void patchElf() {
 static void showHelp(const std::string & progName) {
 	fprintf(stderr, "syntax: %s\n\
   [--replace-needed LIBRARY NEW_LIBRARY]\n\
+  [--variant FILE]\n\
+  [--query json]\n\
+  [--has-symbol NAME[@VERSION|@@VERSION]]\n\
+  [--dep-graph DIR]\n\
+  [--build-index SYSROOT]\n\
+  [--index FILE]\n\
   [--output FILE]\n\
+  [--jobs N]\n\
+  [--max-memory BYTES[K|M|G]]\n\
+  [--read-rate BYTES[K|M|G]]\n\
+  [--write-rate BYTES[K|M|G]]\n\
+  [--iops N]\n\
+  [--low-priority]\n\
+  [--pipeline N]\n\
+  [--stats]\n\
+  [--stats-format text|json]\n\
+  [--stats-baseline FILES_PER_SECOND[:PERCENT]]\n\
+  [--trace FILE]\n\
   [--debug]\n\
   FILENAME...\n", progName.c_str());
 }
 
 
 static int mainWrapped(int argc, char * * argv) {
+    /* Messages logged after the last file (or outside of any file, e.g.
+       by --dep-graph and --build-index) are written out on every way
+       out, not just by reportFile(). */
+    struct LogFlusher {
+        ~LogFlusher() { flushLog(); }
+    } logFlusher;
+
     if (argc <= 1) {
         showHelp(argv[0]);
         return 1;
@@ -1342,37 +3787,187 @@ static int mainWrapped(int argc, char * * argv) {
         std::string arg(argv[i]);
         if (arg == "--replace-needed") {
             if (i+2 >= argc) error("missing argument(s)");
-            neededLibsToReplace[ argv[i+1] ] = argv[i+2];
+            auto & libs = variants.empty() ? neededLibsToReplace : variants.back().neededLibsToReplace;
+            libs[ argv[i+1] ] = argv[i+2];
             i += 2;
         }
+        else if (arg == "--variant") {
+            if (++i == argc) error("missing argument");
+            variants.push_back({ resolveArgument(argv[i]), {} });
+        }
+        else if (arg == "--query") {
+            if (++i == argc) error("missing argument");
+            if (downcase(argv[i]) != "json")
+                error("unknown query format '" + std::string(argv[i]) + "'");
+            queryMode = true;
+        }
+        else if (arg == "--has-symbol") {
+            if (++i == argc) error("missing argument");
+            SymbolQuery query;
+            std::string spec = argv[i];
+            size_t at = spec.find('@');
+            query.name = spec.substr(0, at);
+            if (at != std::string::npos) {
+                query.defaultVersion = spec.compare(at, 2, "@@") == 0;
+                query.version = spec.substr(at + (query.defaultVersion ? 2 : 1));
+            }
+            if (query.name.empty() || (query.version && query.version->empty()))
+                error("invalid symbol '" + spec + "'");
+            query.gnuHash = gnuHash(query.name);
+            query.sysvHash = sysvHash(query.name);
+            symbolQueries.push_back(std::move(query));
+        }
+        else if (arg == "--build-index") {
+            if (++i == argc) error("missing argument");
+            depGraphRoot = resolveArgument(argv[i]);
+            while (!depGraphRoot.empty() && depGraphRoot.back() == '/')
+                depGraphRoot.pop_back();
+            depGraphMode = buildIndexMode = true;
+        }
+        else if (arg == "--index") {
+            if (++i == argc) error("missing argument");
+            indexFileName = resolveArgument(argv[i]);
+        }
+        else if (arg == "--dep-graph") {
+            if (++i == argc) error("missing argument");
+            depGraphRoot = resolveArgument(argv[i]);
+            while (!depGraphRoot.empty() && depGraphRoot.back() == '/')
+                depGraphRoot.pop_back();
+            depGraphMode = true;
+        }
         else if (arg == "--output") {
             if (++i == argc) error("missing argument");
             outputFileName = resolveArgument(argv[i]);
             alwaysWrite = true;
         }
+        else if (arg == "--jobs") {
+            if (++i == argc) error("missing argument");
+            /* More workers than this only add contention. */
+            unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+            jobs = parseCount(argv[i], 16 * cpus);
+            if (jobs == 0)
+                jobs = cpus;
+        }
+        else if (arg == "--max-memory") {
+            if (++i == argc) error("missing argument");
+            maxMemory = parseSize(argv[i]);
+        }
+        else if (arg == "--read-rate") {
+            if (++i == argc) error("missing argument");
+            readBandwidth.setRate(parseSize(argv[i]));
+        }
+        else if (arg == "--write-rate") {
+            if (++i == argc) error("missing argument");
+            writeBandwidth.setRate(parseSize(argv[i]));
+        }
+        else if (arg == "--iops") {
+            if (++i == argc) error("missing argument");
+            ioOperations.setRate(parseSize(argv[i]));
+        }
+        else if (arg == "--low-priority") {
+            lowPriority = true;
+        }
+        else if (arg == "--pipeline") {
+            if (++i == argc) error("missing argument");
+            uint64_t n = parseSize(argv[i]);
+            if (n > 1024)
+                error("pipeline depth too large");
+            pipelineDepth = n;
+        }
         else if (arg == "--debug") {
             debugMode = true;
         }
+        else if (arg == "--stats") {
+            statsMode = true;
+        }
+        else if (arg == "--stats-format") {
+            if (++i == argc) error("missing argument");
+            std::string format = downcase(argv[i]);
+            if (format == "text")
+                statsFormat = StatsFormat::Text;
+            else if (format == "json")
+                statsFormat = StatsFormat::Json;
+            else
+                error("unknown stats format '" + format + "'");
+            statsMode = true;
+        }
+        else if (arg == "--stats-baseline") {
+            if (++i == argc) error("missing argument");
+            std::string spec = argv[i];
+            size_t colon = spec.find(':');
+            try {
+                size_t pos;
+                statsBaseline = std::stod(spec.substr(0, colon), &pos);
+                if (pos != std::min(colon, spec.size())) throw std::invalid_argument(spec);
+                if (colon != std::string::npos) {
+                    statsThreshold = std::stod(spec.substr(colon + 1), &pos);
+                    if (pos != spec.size() - colon - 1) throw std::invalid_argument(spec);
+                }
+            } catch (std::exception &) {
+                error("invalid baseline '" + spec + "'");
+            }
+            if (statsBaseline <= 0 || statsThreshold < 0)
+                error("invalid baseline '" + spec + "'");
+            statsMode = true;
+        }
+        else if (arg == "--trace") {
+            if (++i == argc) error("missing argument");
+            traceFileName = resolveArgument(argv[i]);
+            traceMode = true;
+        }
         else {
             fileNames.push_back(arg);
         }
     }
 
+    if (depGraphMode) {
+        if (!fileNames.empty() || queryMode || !symbolQueries.empty() || !variants.empty() || !neededLibsToReplace.empty() || !outputFileName.empty())
+            error("--dep-graph and --build-index take no FILENAME and cannot be combined with --query, --has-symbol, --variant, --replace-needed or --output");
+        if (buildIndexMode)
+            buildIndex();
+        else
+            buildDepGraph();
+        if (traceMode)
+            writeTrace(traceFileName);
+        return 0;
+    }
+
     if (fileNames.empty()) error("missing filename");
 
     if (!outputFileName.empty() && fileNames.size() != 1)
         error("--output option only allowed with single input file");
+
+    if (queryMode && (!neededLibsToReplace.empty() || !outputFileName.empty()))
+        error("--query is read-only and cannot be combined with --replace-needed or --output");
+
+    if (!symbolQueries.empty() && (queryMode || !neededLibsToReplace.empty() || !outputFileName.empty()))
+        error("--has-symbol is read-only and cannot be combined with --query, --replace-needed or --output");
+
+    if (!variants.empty()) {
+        if (fileNames.size() != 1 || queryMode || !symbolQueries.empty() || !outputFileName.empty())
+            error("--variant takes a single input file and cannot be combined with --query, --has-symbol or --output");
+        for (auto & variant : variants)
+            variant.neededLibsToReplace.insert(neededLibsToReplace.begin(), neededLibsToReplace.end());
+    }
     
     patchElf();
 
+    if (traceMode)
+        writeTrace(traceFileName);
+
     return 0;
 }
 
+/* bench/microbench.cc includes this file for ElfFile and has its own
+   main(). */
+#ifndef PATCHELF_NO_MAIN
 int main(int argc, char * * argv) {
     try {
         return mainWrapped(argc, argv);
     } catch (std::exception & e) {
+        flushLog();
         fprintf(stderr, "patchelf: %s\n", e.what());
         return 1;
     }
 }
+#endif
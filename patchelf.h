@@ -1,14 +1,45 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "stdlib.hpp"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+/* USDT probes for attaching bpftrace/perf to a production binary, e.g.
+   usdt:patchelf:patchelf:span__end { printf("%s\n", str(arg0)); } */
+#define PROBE_SPAN_START(name) DTRACE_PROBE1(patchelf, span__start, name)
+#define PROBE_SPAN_END(name) DTRACE_PROBE1(patchelf, span__end, name)
+#else
+#define PROBE_SPAN_START(name) do { } while (0)
+#define PROBE_SPAN_END(name) do { } while (0)
+#endif
+
 using FileContents = std::shared_ptr<std::vector<unsigned char>>;
 
+using std::span;
+
 #define ElfFileParams class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Addr, class Elf_Off, class Elf_Dyn, class Elf_Sym, class Elf_Versym, class Elf_Verdef, class Elf_Verdaux, class Elf_Verneed, class Elf_Vernaux, class Elf_Rel, class Elf_Rela, unsigned ElfClass
 #define ElfFileParamNames Elf_Ehdr, Elf_Phdr, Elf_Shdr, Elf_Addr, Elf_Off, Elf_Dyn, Elf_Sym, Elf_Versym, Elf_Verdef, Elf_Verdaux, Elf_Verneed, Elf_Vernaux, Elf_Rel, Elf_Rela, ElfClass
 
 static bool debugMode = false;
+static bool statsMode = false;
+static bool traceMode = false;
 
 template<class I>
 constexpr I rdi(I i, bool littleEndian) noexcept {
@@ -52,17 +83,522 @@ static std::string downcase(std::string s) {
     return s;
 }
 
-static void debug(const char * format, ...) {
-    if (debugMode) {
-        va_list ap;
+static std::string jsonEscape(std::string_view s) {
+    std::string r;
+    r.reserve(s.size());
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            r += '\\';
+            r += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            r += buf;
+        } else {
+            r += c;
+        }
+    }
+    return r;
+}
+
+/* Log levels; messages above PATCHELF_LOG_LEVEL are compiled out. */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef PATCHELF_LOG_LEVEL
+#define PATCHELF_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/* How this binary was optimised, e.g. "lto+pgo"; --stats reports it so
+   that throughput measured with different builds can be told apart. */
+#ifndef PATCHELF_BUILD_FLAVOR
+#define PATCHELF_BUILD_FLAVOR "plain"
+#endif
+
+/* Log messages are collected per thread and written out with a single
+   write per flush, so concurrent jobs neither interleave their lines nor
+   contend on stderr.  The buffer is flushed after every file. */
+static thread_local std::string logBuffer;
+
+static void flushLog() {
+    if (logBuffer.empty()) return;
+    fwrite(logBuffer.data(), 1, logBuffer.size(), stderr);
+    logBuffer.clear();
+}
+
+__attribute__((format(printf, 1, 2)))
+static void logMessage(const char * format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    char buf[256];
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    if (static_cast<size_t>(n) < sizeof(buf)) {
+        logBuffer.append(buf, n);
+    } else {
+        size_t old = logBuffer.size();
+        logBuffer.resize(old + n + 1);
         va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        vsnprintf(logBuffer.data() + old, n + 1, format, ap);
         va_end(ap);
+        logBuffer.resize(old + n);
     }
+
+    if (logBuffer.size() >= 64 * 1024)
+        flushLog();
+}
+
+/* These are macros so that the arguments, which often build strings, are
+   not even evaluated unless the message is actually going to be logged. */
+#define debug(...) \
+    do { if (PATCHELF_LOG_LEVEL >= LOG_LEVEL_DEBUG && debugMode) logMessage(__VA_ARGS__); } while (0)
+
+#define warn(format, ...) \
+    do { if (PATCHELF_LOG_LEVEL >= LOG_LEVEL_WARN) logMessage("warning: " format, ##__VA_ARGS__); } while (0)
+
+/* Phases timed by --stats.  Parse is the ElfFile constructor and Plan the
+   edits staged before commit().  Sort, Shift, Headers and Symbols happen
+   inside Rewrite, so their times are also included in it. */
+enum class Phase : unsigned { Read, Parse, Plan, Rewrite, Sort, Shift, Headers, Symbols, Write, Count };
+
+/* Subsystems whose heap usage is accounted per file: the file buffer,
+   replaced section copies, the phdr/shdr copies and the section names. */
+enum class MemCategory : unsigned { File, Sections, Headers, Names, Count };
+
+struct PatchStats {
+    double seconds[static_cast<unsigned>(Phase::Count)] = {};
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t bytesMoved = 0;
+    uint64_t bytesZeroed = 0;
+    unsigned int relocatedPhts = 0;
+    unsigned int newLoadSegments = 0;
+    unsigned int pageShifts = 0;
+    /* Section headers, and the lookups of sections by name with the
+       headers they compared; lookups growing with the section count
+       make a rewrite quadratic. */
+    uint64_t sections = 0;
+    uint64_t sectionLookups = 0;
+    uint64_t sectionsScanned = 0;
+    uint64_t memoryPeak[static_cast<unsigned>(MemCategory::Count)] = {};
+    uint64_t memoryPeakTotal = 0;
+    long maxRssKiB = 0; /* process-wide, as reported by getrusage() */
+
+    /* When work on the file started, for its latency; not summed. */
+    std::chrono::steady_clock::time_point started;
+
+    PatchStats & operator += (const PatchStats & other) {
+        for (unsigned int i = 0; i < static_cast<unsigned>(Phase::Count); ++i)
+            seconds[i] += other.seconds[i];
+        bytesRead += other.bytesRead;
+        bytesWritten += other.bytesWritten;
+        bytesMoved += other.bytesMoved;
+        bytesZeroed += other.bytesZeroed;
+        relocatedPhts += other.relocatedPhts;
+        newLoadSegments += other.newLoadSegments;
+        pageShifts += other.pageShifts;
+        sections += other.sections;
+        sectionLookups += other.sectionLookups;
+        sectionsScanned += other.sectionsScanned;
+        /* High-water marks don't add up across files. */
+        for (unsigned int i = 0; i < static_cast<unsigned>(MemCategory::Count); ++i)
+            memoryPeak[i] = std::max(memoryPeak[i], other.memoryPeak[i]);
+        memoryPeakTotal = std::max(memoryPeakTotal, other.memoryPeakTotal);
+        maxRssKiB = std::max(maxRssKiB, other.maxRssKiB);
+        return *this;
+    }
+};
+
+/* Statistics of the file currently processed by this thread.  The counters
+   are bumped unconditionally (it is cheaper than testing statsMode); only
+   the clock reads are skipped when --stats is off. */
+static thread_local PatchStats fileStats;
+
+/* Live bytes per MemCategory of the file currently processed by this
+   thread.  Reset together with fileStats. */
+static thread_local uint64_t memoryLive[static_cast<unsigned>(MemCategory::Count)];
+
+static void trackMemory(MemCategory category, uint64_t bytes) noexcept {
+    auto c = static_cast<unsigned>(category);
+    memoryLive[c] = bytes;
+    fileStats.memoryPeak[c] = std::max(fileStats.memoryPeak[c], bytes);
+
+    uint64_t total = 0;
+    for (auto live : memoryLive)
+        total += live;
+    fileStats.memoryPeakTotal = std::max(fileStats.memoryPeakTotal, total);
 }
 
+class PhaseTimer {
+public:
+    explicit PhaseTimer(Phase phase) noexcept : phase(phase) {
+        if (statsMode) start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() {
+        if (statsMode)
+            fileStats.seconds[static_cast<unsigned>(phase)] +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer & operator = (const PhaseTimer &) = delete;
+
+private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+/* A finished span for --trace; a "complete" (ph "X") Chrome trace event. */
+struct TraceEvent {
+    const char * name;
+    unsigned int tid;
+    int64_t begin; /* microseconds since traceEpoch */
+    int64_t duration;
+    std::string args; /* members of the JSON "args" object */
+};
+
+static const auto traceEpoch = std::chrono::steady_clock::now();
+static std::mutex traceMutex;
+static std::vector<TraceEvent> traceEvents;
+
+static unsigned int traceThreadId() {
+    static std::atomic<unsigned int> nextId { 1 };
+    thread_local unsigned int id = nextId++;
+    return id;
+}
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char * name) noexcept : name(name) {
+        PROBE_SPAN_START(name);
+        if (traceMode) begin = std::chrono::steady_clock::now();
+    }
+
+    ~TraceSpan() {
+        PROBE_SPAN_END(name);
+        if (!traceMode) return;
+
+        auto end = std::chrono::steady_clock::now();
+        auto us = [](auto d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+        std::lock_guard<std::mutex> lock(traceMutex);
+        traceEvents.push_back({ name, traceThreadId(), us(begin - traceEpoch), us(end - begin), std::move(args) });
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator = (const TraceSpan &) = delete;
+
+    void arg(const char * key, uint64_t value) {
+        if (traceMode)
+            addArg(key, std::to_string(value));
+    }
+
+    void arg(const char * key, std::string_view value) {
+        if (traceMode)
+            addArg(key, "\"" + jsonEscape(value) + "\"");
+    }
+
+private:
+    void addArg(const char * key, const std::string & json) {
+        if (!args.empty()) args += ',';
+        args += "\"" + std::string(key) + "\":" + json;
+    }
+
+    const char * name;
+    std::chrono::steady_clock::time_point begin;
+    std::string args;
+};
+
+/* What a file needs from the dynamic loader, as read from its program
+   headers and dynamic segment by ElfFile::getDependencies(). */
+struct ElfDependencies {
+    unsigned int elfClass = 0;
+    unsigned int machine = 0;
+    std::optional<std::string> interpreter;
+    std::optional<std::string> soname;
+    std::optional<std::string> rpath;
+    std::optional<std::string> runpath;
+    std::vector<std::string> needed;
+
+    /* From .gnu.version_r: the versions required of each library. */
+    struct VersionNeed {
+        std::string file;
+        std::vector<std::string> versions;
+    };
+    std::vector<VersionNeed> verneed;
+
+    /* The exported dynamic symbols, by GNU hash of their name, if
+       requested. */
+    struct Symbol {
+        uint32_t hash;
+        std::string version;
+        bool hidden; /* not the default version */
+    };
+    std::vector<Symbol> symbols;
+};
+
+/* A --has-symbol query: a dynamic symbol name, optionally with the
+   version it must have ("NAME@VER") or have as its default version
+   ("NAME@@VER"), and the hashes of the name for both hash tables. */
+struct SymbolQuery {
+    std::string name;
+    std::optional<std::string> version;
+    bool defaultVersion = false;
+    uint32_t gnuHash = 0;
+    uint32_t sysvHash = 0;
+};
+
+/* Layout of the --build-index file: an IndexHeader followed by the
+   tables it locates, in native byte order so that it can be used
+   straight from mmap().  Strings are offsets into the string table, or
+   indexNoString.  The files are sorted by path; the soname table is an
+   open-addressing hash table (by gnuHash()) of file index + 1, 0 for an
+   empty slot. */
+static const char indexMagic[8] = { 'P', 'E', 'I', 'D', 'X', 0, 0, 3 };
+static const uint32_t indexNoString = 0xffffffff;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t fileCount;
+    uint32_t neededCount;
+    uint32_t symbolCount;
+    uint32_t sonameSlots; /* a power of two */
+    uint64_t stringsSize;
+    uint64_t files;
+    uint64_t needed;
+    uint64_t symbols;
+    uint64_t sonames;
+    uint64_t strings;
+};
+
+/* The identity of a file when it was indexed; an entry is only used while
+   all of it still matches. */
+struct FileStamp {
+    uint64_t inode = 0;
+    uint64_t mtimeNs = 0;
+    uint64_t size = 0;
+
+    bool operator==(const FileStamp & other) const {
+        return inode == other.inode && mtimeNs == other.mtimeNs && size == other.size;
+    }
+};
+
+struct IndexFile {
+    FileStamp stamp;
+    uint32_t path;
+    uint32_t soname;
+    uint32_t rpath;
+    uint32_t runpath;
+    uint32_t firstNeeded; /* into the table of string offsets */
+    uint32_t neededCount;
+    uint32_t firstSymbol; /* sorted by hash within a file */
+    uint32_t symbolCount;
+    uint16_t elfClass;
+    uint16_t machine;
+    uint32_t reserved;
+};
+
+struct IndexSymbol {
+    uint32_t hash;
+    uint32_t version; /* indexSymbolHidden is set if not the default version */
+};
+static const uint32_t indexSymbolHidden = 0x80000000;
+
 template<ElfFileParams>
 class ElfFile {
-	private:
+	public:
 		FileContents fileContents;
+
+		explicit ElfFile(FileContents fileContents);
+		~ElfFile();
+
+		[[nodiscard]] bool isChanged() const noexcept { return changed; }
+
+	private:
+		std::vector<Elf_Phdr> phdrs;
+		std::vector<Elf_Shdr> shdrs;
+
+		bool littleEndian;
+
+		bool changed = false;
+
+		bool isExecutable = false;
+
+		using SectionName = std::string;
+		using ReplacedSections = std::map<SectionName, std::string>;
+
+		ReplacedSections replacedSections;
+
+		std::string sectionNames; /* content of the .shstrtab section */
+
+		/* Align on 4 or 8 bytes boundaries on 32- or 64-bit platforms
+		   respectively. */
+		static constexpr size_t sectionAlignment = sizeof(Elf_Off);
+
+		std::vector<SectionName> sectionsByOldIndex;
+
+		/* bench/microbench.cc times the private rewrite steps one by one. */
+		friend struct ElfFileBench;
+
+		[[nodiscard]] unsigned int getPageSize() const noexcept;
+
+		void sortPhdrs();
+		void sortShdrs();
+
+		void shiftFile(size_t extraPages, size_t startOffset, size_t extraBytes);
+
+		[[nodiscard]] std::string getSectionName(const Elf_Shdr & shdr) const;
+
+		const Elf_Shdr & findSectionHeader(const SectionName & sectionName) const;
+		[[nodiscard]] std::optional<std::reference_wrapper<const Elf_Shdr>> tryFindSectionHeader(const SectionName & sectionName) const;
+
+		template<class T> span<T> getSectionSpan(const Elf_Shdr & shdr) const;
+		template<class T> span<T> getSectionSpan(const SectionName & sectionName);
+		template<class T> span<T> tryGetSectionSpan(const SectionName & sectionName);
+
+		[[nodiscard]] unsigned int getSectionIndex(const SectionName & sectionName) const;
+
+		std::string & replaceSection(const SectionName & sectionName, size_t size);
+		[[nodiscard]] bool hasReplacedSection(const SectionName & sectionName) const;
+		[[nodiscard]] bool canReplaceSection(const SectionName & sectionName) const;
+
+		void writeReplacedSections(Elf_Off & curOff, Elf_Addr startAddr, Elf_Off startOffset);
+
+		void rewriteHeaders(Elf_Addr phdrAddress);
+
+		void rewriteSectionsLibrary();
+		void rewriteSectionsExecutable();
+
+		void normalizeNoteSegments();
+
+		void rewriteSections(bool force = false);
+
+		/* Convert an integer in big or little endian representation (as
+		   specified by the ELF header) to this platform's integer
+		   representation. */
+		template<class I>
+		constexpr I rdi(I i) const noexcept { return ::rdi(i, littleEndian); }
+
+		/* Convert back to the ELF representation. */
+		template<class I, class U>
+		constexpr inline I wri(I & t, U i) const
+		{
+			I val = static_cast<I>(i);
+			if (static_cast<U>(val) != i)
+				throw std::runtime_error { "value truncation" };
+			t = rdi(val);
+			return val;
+		}
+
+		[[nodiscard]] Elf_Ehdr *hdr() noexcept { return (Elf_Ehdr *)fileContents->data(); }
+		[[nodiscard]] const Elf_Ehdr *hdr() const noexcept { return (const Elf_Ehdr *)fileContents->data(); }
+
+		/* Report the current heap footprint to trackMemory(). */
+		void accountMemory() const;
+
+		/* Current index of every section, by its index in the input
+		   file; kept up to date by sortShdrs(). */
+		std::vector<unsigned int> sectionIndexes;
+
+		/* Containers of the last ElfFile destroyed on this thread.  The
+		   next one takes them over, so that a batch doesn't reallocate
+		   the header tables and name strings for every file. */
+		struct Scratch {
+			std::vector<Elf_Phdr> phdrs;
+			std::vector<Elf_Shdr> shdrs;
+			std::string sectionNames;
+			std::vector<std::string> sectionsByOldIndex;
+			std::vector<unsigned int> sectionIndexes;
+
+			/* Working storage of sortBy(). */
+			std::vector<unsigned int> order;
+			std::vector<unsigned int> inverseOrder;
+			std::vector<Elf_Phdr> sortedPhdrs;
+			std::vector<Elf_Shdr> sortedShdrs;
+		};
+		inline static thread_local Scratch scratch;
+
+		[[nodiscard]] std::string_view getSectionNameView(const Elf_Shdr & shdr) const;
+
+		/* Stably reorder hdrs[first..] by the given comparison of indices. */
+		template<class Hdr, class Less>
+		static void sortBy(std::vector<Hdr> & hdrs, std::vector<Hdr> & sorted, size_t first, Less less);
+
+		/* File offset of size bytes at addr, through the PT_LOAD segments. */
+		[[nodiscard]] Elf_Off vaddrToOffset(Elf_Addr addr, size_t size) const;
+
+		/* The dynamic table and the tables it refers to, located through
+		   the program headers alone; dyn is null if there is no
+		   PT_DYNAMIC.  verNeed is a file offset. */
+		struct DynamicTable {
+			Elf_Dyn * dyn = nullptr;
+			size_t count = 0;
+			char * strTab = nullptr;
+			size_t strTabSize = 0;
+			Elf_Off verNeed = 0;
+			size_t verNeedNum = 0;
+
+			/* File offsets of the dynamic symbol table and the tables
+			   describing it, 0 if absent. */
+			Elf_Off symTab = 0;
+			Elf_Off hash = 0;
+			Elf_Off gnuHash = 0;
+			Elf_Off verSym = 0;
+			Elf_Off verDef = 0;
+			size_t verDefNum = 0;
+		};
+		[[nodiscard]] DynamicTable findDynamicTable() const;
+		[[nodiscard]] std::string_view getDynamicString(const DynamicTable & table, size_t offset) const;
+
+		/* Number of entries of the dynamic symbol table, from DT_HASH or
+		   DT_GNU_HASH since the dynamic segment doesn't record it. */
+		[[nodiscard]] size_t getDynamicSymbolCount(const DynamicTable & table) const;
+
+		/* count 32-bit words at a file offset, bounds checked. */
+		[[nodiscard]] const uint32_t * getWords(Elf_Off offset, size_t count) const;
+
+		/* The version names defined by .gnu.version_d, by version index. */
+		[[nodiscard]] std::vector<std::string_view> getVersionNames(const DynamicTable & table) const;
+
+		/* Whether a dynamic symbol is defined here and visible to other
+		   objects. */
+		[[nodiscard]] bool isExportedSymbol(const Elf_Sym & sym) const;
+
+		/* replaceNeeded() for files without section headers. */
+		void replaceNeededInPlace(const std::map<std::string, std::string> & libs);
+
+		/* Strings appended to each string table since the last commit(),
+		   so that edits adding the same string share it. */
+		std::map<SectionName, std::unordered_map<std::string, Elf_Off>> addedStrings;
+
+		/* Append a string to a string table, staging a replaced copy of
+		   it; returns its offset in the table. */
+		Elf_Off addString(const SectionName & sectionName, const std::string & s);
+
+		/* The string at an offset of a string table as staged, so that
+		   strings added by earlier edits can be read back. */
+		[[nodiscard]] const char * getStagedString(const Elf_Shdr & shdr, size_t offset) const;
+
+	public:
+		/* Edits such as replaceNeeded() only stage their changes: new
+		   section contents in replacedSections, anything that keeps its
+		   size in place.  commit() then lays the file out once for all
+		   of them, so N edits cost a single layout pass. */
+		void commit();
+
+		void replaceNeeded(const std::map<std::string, std::string> & libs);
+
+		[[nodiscard]] ElfDependencies getDependencies(bool withSymbols = false) const;
+
+		/* Which of the queried symbols are exported, looked up through
+		   DT_GNU_HASH (or DT_HASH) rather than by reading .dynsym. */
+		[[nodiscard]] std::vector<bool> hasSymbols(const std::vector<SymbolQuery> & queries) const;
+
+		/* A copy of this parsed, unmodified file to be patched separately:
+		   the headers and section names are taken over as they are, the
+		   contents are copied into a buffer of its own. */
+		[[nodiscard]] ElfFile forkVariant() const;
 };
@@ -0,0 +1,81 @@
+#! /bin/sh -e
+# --replace-needed on files without section headers, where .dynstr can't
+# grow: a name is pointed at an existing copy of its replacement or
+# overwritten in place.  Each case lists the DT_NEEDED entries expected
+# afterwards, in every class and byte order.
+#
+# Uses $PATCHELF and $MKELF if set, otherwise builds both with
+# bench/build.sh.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=${SCRATCH:-$SRC/_build/tests/replace-in-place}
+
+if [ -z "$PATCHELF" ] || [ -z "$MKELF" ]; then
+    "$SRC/bench/build.sh" patchelf mkelf >/dev/null
+    PATCHELF=${PATCHELF:-$SRC/_build/patchelf}
+    MKELF=${MKELF:-$SRC/_build/mkelf}
+fi
+
+rm -rf "$SCRATCH"
+mkdir -p "$SCRATCH"
+
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+needed() {
+    readelf -d "$1" | sed -n 's/.*(NEEDED).*\[\(.*\)\]/\1/p' | tr '\n' ' '
+}
+
+# check NAME EXPECTED ARGS...: EXPECTED is the DT_NEEDED list, or "error"
+# if patchelf has to refuse.
+check() {
+    name=$1
+    expected=$2
+    shift 2
+    out=$file.$name
+    if ! "$PATCHELF" "$@" --output "$out" "$file" 2> "$out.log"; then
+        [ "$expected" = error ] || fail "$format $name: patchelf failed: $(cat "$out.log")"
+        return
+    fi
+    if [ "$expected" = error ]; then
+        fail "$format $name: patchelf should have refused"
+        return
+    fi
+    actual=$(needed "$out")
+    if [ "$actual" != "$expected" ]; then
+        fail "$format $name: DT_NEEDED is '$actual', expected '$expected'"
+    fi
+    if readelf -a -W "$out" 2>&1 >/dev/null | grep -q "Error:"; then
+        fail "$format $name: readelf finds errors"
+    fi
+}
+
+for class in 32 64; do
+    for endian in little big; do
+        format=$class-$endian
+        file=$SCRATCH/$format
+        "$MKELF" --class $class --endian $endian --needed 3 --no-section-headers "$file"
+
+        check shorter "liba.so libneeded1.so libneeded2.so " \
+            --replace-needed libneeded0.so liba.so
+        check existing "libneeded2.so libneeded1.so libneeded2.so " \
+            --replace-needed libneeded0.so libneeded2.so
+        check swap "libneeded1.so libneeded0.so libneeded2.so " \
+            --replace-needed libneeded0.so libneeded1.so --replace-needed libneeded1.so libneeded0.so
+        # libneeded1.so is overwritten, so libneeded0.so can't point at it.
+        check chain "libneeded1.so libX.so libneeded2.so " \
+            --replace-needed libneeded0.so libneeded1.so --replace-needed libneeded1.so libX.so
+        check longer error \
+            --replace-needed libneeded0.so libneeded0-with-a-longer-name.so
+    done
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failures"
+    exit 1
+fi
+echo "all in-place replacements passed"
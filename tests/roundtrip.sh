@@ -0,0 +1,124 @@
+#! /bin/sh -e
+# Round trip of --replace-needed on generated images (bench/elfgen.h):
+# every class, byte order and file type, a file with extended section
+# numbering (more than SHN_LORESERVE sections) and a file with offsets
+# past 4 GiB.  A DT_NEEDED entry is replaced by a longer name, which moves
+# .dynstr, and then back; the dependencies, the dynamic symbols and the
+# section names must come out unchanged and readelf must not find errors.
+#
+# The >4 GiB case needs a little more than the file size in memory and is
+# skipped without it, unless PATCHELF_TEST_LARGE=1.  LARGE_FILE_SIZE
+# overrides the size.
+#
+# Uses $PATCHELF and $MKELF if set, otherwise builds both with
+# bench/build.sh.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=${SCRATCH:-$SRC/_build/tests/roundtrip}
+
+if [ -z "$PATCHELF" ] || [ -z "$MKELF" ]; then
+    "$SRC/bench/build.sh" patchelf mkelf >/dev/null
+    PATCHELF=${PATCHELF:-$SRC/_build/patchelf}
+    MKELF=${MKELF:-$SRC/_build/mkelf}
+fi
+
+rm -rf "$SCRATCH"
+mkdir -p "$SCRATCH"
+
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# What must survive the round trip.
+summary() {
+    readelf -d -W "$1" | grep NEEDED
+    readelf --dyn-syms -W "$1" | awk '$1 ~ /:$/ { print $2, $3, $4, $8 }'
+    readelf -S -W "$1" | sed -n 's/^ *\[ *[0-9]*\] \([^ ]*\).*/\1/p' | sort
+}
+
+check() {
+    name=$1
+    file=$SCRATCH/$name
+    long=/opt/roundtrip/lib/libneeded1-with-a-much-longer-name.so.1
+
+    summary "$file" > "$file.before"
+
+    if ! "$PATCHELF" --replace-needed libneeded1.so "$long" --output "$file.patched" "$file"; then
+        fail "$name: patchelf failed"
+        return
+    fi
+    if readelf -a -W "$file.patched" 2>&1 >/dev/null | grep -q "Error:"; then
+        fail "$name: readelf finds errors in the patched file"
+        readelf -a -W "$file.patched" 2>&1 >/dev/null | grep "Error:" | sort -u | head -3
+    fi
+    if ! readelf -d "$file.patched" | grep -q "$long"; then
+        fail "$name: DT_NEEDED entry not replaced"
+    fi
+
+    if ! "$PATCHELF" --replace-needed "$long" libneeded1.so --output "$file.restored" "$file.patched"; then
+        fail "$name: patchelf failed on the patched file"
+        return
+    fi
+    summary "$file.restored" > "$file.after"
+    if ! cmp -s "$file.before" "$file.after"; then
+        fail "$name: the round trip changed the file"
+        diff "$file.before" "$file.after" | head -10
+    fi
+}
+
+# Every class, byte order and type; the section headers are shuffled so
+# that patchelf has to sort them.
+for class in 32 64; do
+    for endian in little big; do
+        for type in dyn exec; do
+            name=format-$class-$endian-$type
+            "$MKELF" --class $class --endian $endian --type $type --sections 16 --symbols 64 \
+                --needed 3 --notes 3 --notes-per-segment 2 --shuffle-headers "$SCRATCH/$name"
+            check $name
+        done
+    done
+done
+
+# Extended section numbering: e_shnum is 0 and .shstrtab is past
+# SHN_LORESERVE before and after.
+for type in dyn exec; do
+    name=xindex-$type
+    "$MKELF" --type $type --sections 70000 --shuffle-headers "$SCRATCH/$name"
+    check $name
+    for file in "$SCRATCH/$name.patched" "$SCRATCH/$name.restored"; do
+        if ! readelf -h "$file" | grep -q "Number of section headers: *0 (700"; then
+            fail "$name: extended section count lost in $(basename "$file")"
+        fi
+        if ! readelf -h "$file" | grep -q "Section header string table index: *65535 (700"; then
+            fail "$name: extended .shstrtab index lost in $(basename "$file")"
+        fi
+    done
+done
+
+# Offsets past 4 GiB: the section headers and the non-allocated sections
+# sit behind a 4.5 GiB hole.
+size=${LARGE_FILE_SIZE:-4831838208}
+available=$(awk '/^MemAvailable:/ { printf "%.0f\n", $2 * 1024 }' /proc/meminfo 2>/dev/null || echo 0)
+if [ "$PATCHELF_TEST_LARGE" = 1 ] || [ "${available:-0}" -ge $((size + size / 8)) ]; then
+    for type in dyn exec; do
+        name=large-$type
+        "$MKELF" --type $type --file-size $size "$SCRATCH/$name"
+        check $name
+        shoff=$(readelf -h "$SCRATCH/$name.patched" | awk '/Start of section headers/ { print $5 }')
+        if [ "$shoff" -le "$size" ]; then
+            fail "$name: section headers at $shoff, expected past $size"
+        fi
+        rm -f "$SCRATCH/$name" "$SCRATCH/$name.patched" "$SCRATCH/$name.restored"
+    done
+else
+    echo "SKIP: offsets past 4 GiB (needs $(((size + size / 8 + 1073741823) / 1073741824)) GiB of memory, or PATCHELF_TEST_LARGE=1)"
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failures"
+    exit 1
+fi
+echo "all round trips passed"
@@ -0,0 +1,44 @@
+/* Stage several edits on one ElfFile and lay them out with a single
+   commit(), which the command line never does (it makes one
+   replaceNeeded() call per file):
+
+     staged-edits INPUT OUTPUT OLD NEW [OLD NEW]...
+
+   Every OLD NEW pair is a replaceNeeded() call of its own, so a pair can
+   rename a library to a name that only an earlier pair has added to the
+   staged .dynstr.
+
+   Built and run by tests/staged-edits.sh. */
+
+#define PATCHELF_NO_MAIN
+#include "../patchelf.cc"
+
+template<class Elf>
+static FileContents stageAndCommit(const FileContents & contents, int pairs, char * * argv) {
+    Elf elfFile(contents);
+    for (int i = 0; i < pairs; ++i)
+        elfFile.replaceNeeded({ { argv[2 * i], argv[2 * i + 1] } });
+    elfFile.commit();
+    return elfFile.fileContents;
+}
+
+int main(int argc, char * * argv) {
+    if (argc < 5 || argc % 2 == 0) {
+        fprintf(stderr, "syntax: %s INPUT OUTPUT OLD NEW [OLD NEW]...\n", argv[0]);
+        return 1;
+    }
+    try {
+        auto contents = readFile(argv[1]);
+        if (!contents) error(std::string("cannot read '") + argv[1] + "'");
+        int pairs = (argc - 3) / 2;
+        if (getElfType(contents).is32Bit)
+            contents = stageAndCommit<ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>>(contents, pairs, argv + 3);
+        else
+            contents = stageAndCommit<ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>>(contents, pairs, argv + 3);
+        writeFile(argv[2], contents);
+    } catch (std::exception & e) {
+        fprintf(stderr, "staged-edits: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
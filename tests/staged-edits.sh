@@ -0,0 +1,92 @@
+#! /bin/sh -e
+# Several replaceNeeded() calls staged before one commit(), through
+# tests/staged-edits.cc: the second call renames the name the first one
+# added to .dynstr, the third reuses it.  The DT_NEEDED entries must come
+# out as if the edits had been applied one after the other, and readelf
+# must not find errors, in every class, byte order and file type.  A
+# copy of /bin/ls whose libraries are renamed to their absolute paths in
+# three staged edits must still run.
+#
+# Uses $MKELF if set, otherwise builds it with bench/build.sh; $CXX
+# (default g++) builds the driver.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=${SCRATCH:-$SRC/_build/tests/staged-edits}
+CXX=${CXX:-g++}
+
+if [ -z "$MKELF" ]; then
+    "$SRC/bench/build.sh" mkelf >/dev/null
+    MKELF=$SRC/_build/mkelf
+fi
+
+rm -rf "$SCRATCH"
+mkdir -p "$SCRATCH"
+
+STAGED=$SCRATCH/staged-edits
+$CXX -std=c++17 -O2 -I"$SRC" "$SRC/tests/staged-edits.cc" -o "$STAGED"
+
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+needed() {
+    readelf -d "$1" | sed -n 's/.*(NEEDED).*\[\(.*\)\]/\1/p' | tr '\n' ' '
+}
+
+a=/opt/staged/lib/libA-with-a-longer-name.so
+b=/opt/staged/lib/libB-with-an-even-longer-name.so
+
+for class in 32 64; do
+    for endian in little big; do
+        for type in dyn exec; do
+            format=$class-$endian-$type
+            file=$SCRATCH/$format
+            "$MKELF" --class $class --endian $endian --type $type --needed 3 "$file"
+            if ! "$STAGED" "$file" "$file.staged" \
+                libneeded0.so $a  $a $b  libneeded1.so $a; then
+                fail "$format: staging failed"
+                continue
+            fi
+            actual=$(needed "$file.staged")
+            if [ "$actual" != "$b $a libneeded2.so " ]; then
+                fail "$format: DT_NEEDED is '$actual'"
+            fi
+            if readelf -a -W "$file.staged" 2>&1 >/dev/null | grep -q "Error:"; then
+                fail "$format: readelf finds errors"
+            fi
+        done
+    done
+done
+
+# A real executable: libc.so.6 becomes its path, then that path (read
+# back from the staged .dynstr) a spelling of it with a double slash,
+# and a second library its path.
+libc=$(ldd /bin/ls 2>/dev/null | awk '$1 == "libc.so.6" { print $3 }')
+other=$(ldd /bin/ls 2>/dev/null | awk '$2 == "=>" && $1 != "libc.so.6" && $3 ~ /^\// { print $1, $3; exit }')
+if [ -n "$libc" ] && [ -n "$other" ]; then
+    cp /bin/ls "$SCRATCH/ls"
+    doubled=$(dirname "$libc")//$(basename "$libc")
+    if ! "$STAGED" "$SCRATCH/ls" "$SCRATCH/ls.staged" \
+        libc.so.6 "$libc"  "$libc" "$doubled"  $other; then
+        fail "ls: staging failed"
+    else
+        chmod +x "$SCRATCH/ls.staged"
+        actual=$(needed "$SCRATCH/ls.staged")
+        case " $actual" in
+        *" $doubled "*) ;;
+        *) fail "ls: DT_NEEDED is '$actual'" ;;
+        esac
+        "$SCRATCH/ls.staged" / >/dev/null || fail "ls: the staged binary doesn't run"
+    fi
+else
+    echo "SKIP: ls (no dynamically linked /bin/ls with ldd)"
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failures"
+    exit 1
+fi
+echo "all staged edits passed"
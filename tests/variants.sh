@@ -0,0 +1,86 @@
+#! /bin/sh -e
+# --variant against separate runs: every output of one run with several
+# --variant options must be byte-identical to a run with --output and
+# the same rules.  Covers a variant that relocates .dynstr, one that
+# fits its names in place, one without rules, and a variant rule
+# overriding a shared one, in every class, byte order and file type and
+# on a file without section headers.
+#
+# Uses $PATCHELF and $MKELF if set, otherwise builds both with
+# bench/build.sh.
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=${SCRATCH:-$SRC/_build/tests/variants}
+
+if [ -z "$PATCHELF" ] || [ -z "$MKELF" ]; then
+    "$SRC/bench/build.sh" patchelf mkelf >/dev/null
+    PATCHELF=${PATCHELF:-$SRC/_build/patchelf}
+    MKELF=${MKELF:-$SRC/_build/mkelf}
+fi
+
+rm -rf "$SCRATCH"
+mkdir -p "$SCRATCH"
+
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+long="--replace-needed libneeded0.so /opt/variants/lib/libneeded0-with-a-much-longer-name.so"
+short="--replace-needed libneeded1.so libv.so"
+shared="--replace-needed libneeded2.so libshared.so"
+override="--replace-needed libneeded2.so libover.so"
+
+# same NAME VARIANT ARGS...: VARIANT must equal a separate run with ARGS.
+same() {
+    name=$1
+    variant=$2
+    shift 2
+    if ! "$PATCHELF" "$@" --output "$file.$name.separate" "$file"; then
+        fail "$format $name: separate run failed"
+    elif ! cmp -s "$variant" "$file.$name.separate"; then
+        fail "$format $name: --variant output differs from a separate run"
+    fi
+}
+
+for input in 32-little-dyn 32-big-exec 64-little-dyn 64-little-exec 64-big-dyn 64-little-dyn-nosht; do
+    format=$input
+    file=$SCRATCH/$input
+    set -- $(echo "$input" | tr - ' ')
+    flags="--class $1 --endian $2 --type $3 --needed 3"
+    [ "$4" = nosht ] && flags="$flags --no-section-headers"
+    "$MKELF" $flags "$file"
+
+    # A file without section headers can't grow .dynstr.
+    first=$long
+    [ "$4" = nosht ] && first=$short
+
+    if ! "$PATCHELF" "$file" \
+        --variant "$file.first" $first \
+        --variant "$file.second" $shared \
+        --variant "$file.noop"; then
+        fail "$format: --variant run failed"
+        continue
+    fi
+    same first "$file.first" $first
+    same second "$file.second" $shared
+    same noop "$file.noop"
+    cmp -s "$file" "$file.noop" || fail "$format noop: output differs from the input"
+
+    if ! "$PATCHELF" $shared "$file" \
+        --variant "$file.shared" \
+        --variant "$file.override" $override; then
+        fail "$format: --variant run with shared rules failed"
+        continue
+    fi
+    same shared "$file.shared" $shared
+    same override "$file.override" $override
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failures"
+    exit 1
+fi
+echo "all variants match separate runs"